@@ -0,0 +1,32 @@
+QT = core gui network testlib
+
+greaterThan(QT_MAJOR_VERSION, 4) {
+    QT += widgets concurrent
+}
+
+TARGET = bench_trackview
+CONFIG   += console
+CONFIG   -= app_bundle
+
+TEMPLATE = app
+
+# zlib, as bundled with Qt on Windows and from the system elsewhere
+win32: INCLUDEPATH += $$[QT_INSTALL_HEADERS]/QtZlib
+else: LIBS += -lz
+
+HEADERS += gzipdevice.h \
+           keyblock.h \
+           syncdocument.h \
+           syncjournal.h \
+           syncpage.h \
+           synctrack.h \
+           trackview.h
+
+SOURCES += bench_trackview.cpp \
+           gzipdevice.cpp \
+           keyblock.cpp \
+           syncdocument.cpp \
+           syncdocumentbinary.cpp \
+           syncjournal.cpp \
+           syncpage.cpp \
+           trackview.cpp
@@ -0,0 +1,65 @@
+#include <QString>
+#include <QtTest>
+#include <QImage>
+#include "syncdocument.h"
+#include "trackview.h"
+
+class TrackViewBenchmark : public QObject
+{
+	Q_OBJECT
+
+private Q_SLOTS:
+	void initTestCase();
+	void cleanupTestCase();
+	void paintFullScreen();
+
+private:
+	SyncDocument *doc;
+	TrackView *view;
+};
+
+void TrackViewBenchmark::initTestCase()
+{
+	doc = new SyncDocument;
+	doc->setRows(8192);
+
+	// 100 columns with a key every fourth row, all interpolation types
+	for (int i = 0; i < 100; ++i) {
+		SyncTrack *t = doc->createTrack(QString("track%1").arg(i));
+		for (int row = 0; row < doc->getRows(); row += 4) {
+			SyncTrack::TrackKey k;
+			k.row = row;
+			k.value = float((row * 7 + i * 13) % 1000) / 10.0f;
+			k.type = SyncTrack::TrackKey::KeyType((row / 4 + i) % SyncTrack::TrackKey::KEY_TYPE_COUNT);
+			t->setKey(k);
+		}
+	}
+
+	view = new TrackView(doc->getSyncPage(0), NULL);
+	view->resize(3840, 2160);
+	view->show();
+}
+
+void TrackViewBenchmark::cleanupTestCase()
+{
+	delete view;
+	delete doc;
+}
+
+void TrackViewBenchmark::paintFullScreen()
+{
+	QImage image(view->viewport()->size(), QImage::Format_ARGB32_Premultiplied);
+
+	// let the tiles of the first frame come back from the thread pool
+	view->viewport()->render(&image);
+	QThreadPool::globalInstance()->waitForDone();
+	QCoreApplication::processEvents();
+
+	QBENCHMARK {
+		view->viewport()->render(&image);
+	}
+}
+
+QTEST_MAIN(TrackViewBenchmark)
+
+#include "bench_trackview.moc"
@@ -0,0 +1,309 @@
+#include "curveview.h"
+
+#include <QPainter>
+#include <QPaintEvent>
+#include <QWheelEvent>
+
+#include <float.h>
+
+static void addValue(float value, float *min, float *max)
+{
+	*min = qMin(*min, value);
+	*max = qMax(*max, value);
+}
+
+// extremes over the rows [start, stop], evaluated from the keys
+static void evalRange(const SyncTrack *track, int start, int stop, float *min, float *max)
+{
+	*min = *max = float(track->getValue(start));
+	addValue(float(track->getValue(stop)), min, max);
+
+	SyncTrack::const_iterator it = track->lowerBound(start + 1);
+	for (; it != track->end() && it->row <= stop; ++it) {
+		// the end of the previous segment, and the start of the next
+		addValue(float(track->getValue(it->row - 1)), min, max);
+		addValue(it->value, min, max);
+	}
+}
+
+void CurvePyramid::rebuild(const SyncTrack *track, int rows)
+{
+	this->rows = qMax(rows, 1);
+	mins.clear();
+	maxs.clear();
+
+	int count = (this->rows + BLOCK_ROWS - 1) / BLOCK_ROWS;
+	while (true) {
+		mins.append(QVector<float>(count));
+		maxs.append(QVector<float>(count));
+		if (count == 1)
+			break;
+		count = (count + 1) / 2;
+	}
+
+	update(track, 0, this->rows - 1);
+}
+
+void CurvePyramid::updateBlock(const SyncTrack *track, int block)
+{
+	int first = block * BLOCK_ROWS;
+	int last = qMin(first + BLOCK_ROWS, rows) - 1;
+	evalRange(track, first, last, &mins[0][block], &maxs[0][block]);
+}
+
+void CurvePyramid::update(const SyncTrack *track, int start, int stop)
+{
+	start = qBound(0, start, rows - 1);
+	stop = qBound(start, stop, rows - 1);
+
+	int first = start / BLOCK_ROWS;
+	int last = stop / BLOCK_ROWS;
+	for (int block = first; block <= last; ++block)
+		updateBlock(track, block);
+
+	// propagate up to the root
+	for (int level = 1; level < mins.size(); ++level) {
+		first /= 2;
+		last /= 2;
+
+		const QVector<float> &childMins = mins[level - 1];
+		const QVector<float> &childMaxs = maxs[level - 1];
+		for (int i = first; i <= last; ++i) {
+			int child = i * 2;
+			float min = childMins[child], max = childMaxs[child];
+			if (child + 1 < childMins.size()) {
+				min = qMin(min, childMins[child + 1]);
+				max = qMax(max, childMaxs[child + 1]);
+			}
+			mins[level][i] = min;
+			maxs[level][i] = max;
+		}
+	}
+}
+
+void CurvePyramid::getRange(const SyncTrack *track, int start, int stop, float *min, float *max) const
+{
+	start = qBound(0, start, rows - 1);
+	stop = qBound(start, stop, rows - 1);
+
+	// the blocks that lie wholly inside; the last one may be cut short
+	// by the end of the document
+	int first = (start + BLOCK_ROWS - 1) / BLOCK_ROWS;
+	int last = stop == rows - 1 ? stop / BLOCK_ROWS : (stop + 1) / BLOCK_ROWS - 1;
+
+	// zoomed in far enough that the keys are cheaper than the blocks
+	if (last - first < 1) {
+		evalRange(track, start, stop, min, max);
+		return;
+	}
+
+	// the rows sticking out at either end come from the keys...
+	float lo, hi;
+	*min = FLT_MAX;
+	*max = -FLT_MAX;
+	if (start < first * BLOCK_ROWS) {
+		evalRange(track, start, first * BLOCK_ROWS - 1, &lo, &hi);
+		addValue(lo, min, max);
+		addValue(hi, min, max);
+	}
+	if (stop >= (last + 1) * BLOCK_ROWS) {
+		evalRange(track, (last + 1) * BLOCK_ROWS, stop, &lo, &hi);
+		addValue(lo, min, max);
+		addValue(hi, min, max);
+	}
+
+	// ...and the blocks from the fewest nodes that cover them exactly,
+	// climbing a level whenever both ends line up with a parent
+	for (int level = 0; first <= last; ++level) {
+		if (first & 1) {
+			addValue(mins[level][first], min, max);
+			addValue(maxs[level][first], min, max);
+			++first;
+		}
+		if (!(last & 1) && first <= last) {
+			addValue(mins[level][last], min, max);
+			addValue(maxs[level][last], min, max);
+			--last;
+		}
+		first /= 2;
+		last = (last - 1) / 2;
+	}
+}
+
+CurveView::CurveView(QWidget *parent) :
+    QWidget(parent),
+    track(NULL),
+    rows(0),
+    row(0),
+    viewStart(0),
+    viewRows(0)
+{
+	setMinimumHeight(60);
+}
+
+CurveView::~CurveView()
+{
+	clearPyramids();
+}
+
+void CurveView::setTrack(SyncTrack *track)
+{
+	if (this->track != track) {
+		this->track = track;
+		update();
+	}
+}
+
+void CurveView::setRows(int rows)
+{
+	this->rows = rows;
+	clearPyramids();
+
+	viewStart = 0;
+	viewRows = 0;
+	update();
+}
+
+void CurveView::setRow(int row)
+{
+	this->row = row;
+
+	// keep the cursor in sight when zoomed in
+	if (viewRows > 0 && (row < viewStart || row >= viewStart + viewRows))
+		viewStart = qBound(0, row - viewRows / 2, rows - viewRows);
+
+	update();
+}
+
+CurvePyramid *CurveView::getPyramid(SyncTrack *track)
+{
+	CurvePyramid *pyramid = pyramids.value(track);
+	if (pyramid)
+		return pyramid;
+
+	pyramid = new CurvePyramid;
+	pyramid->rebuild(track, rows);
+	pyramids.insert(track, pyramid);
+
+	connect(track, SIGNAL(keysChanged(const SyncTrack::KeyChanges &)),
+	        this, SLOT(onKeysChanged(const SyncTrack::KeyChanges &)));
+	connect(track, SIGNAL(destroyed(QObject *)),
+	        this, SLOT(onTrackDestroyed(QObject *)));
+	return pyramid;
+}
+
+void CurveView::clearPyramids()
+{
+	QHash<SyncTrack *, CurvePyramid *>::const_iterator it;
+	for (it = pyramids.constBegin(); it != pyramids.constEnd(); ++it) {
+		disconnect(it.key(), 0, this, 0);
+		delete it.value();
+	}
+	pyramids.clear();
+}
+
+void CurveView::onKeysChanged(const SyncTrack::KeyChanges &changes)
+{
+	SyncTrack *track = qobject_cast<SyncTrack *>(sender());
+	CurvePyramid *pyramid = pyramids.value(track);
+	if (!pyramid)
+		return;
+
+	for (int i = 0; i < changes.intervals.size(); ++i)
+		pyramid->update(track, changes.intervals[i].first, changes.intervals[i].second);
+
+	if (track == this->track)
+		update();
+}
+
+void CurveView::onTrackDestroyed(QObject *obj)
+{
+	// too late for a qobject_cast, the pointer is only used as a key
+	SyncTrack *track = static_cast<SyncTrack *>(obj);
+	delete pyramids.take(track);
+	if (this->track == track)
+		this->track = NULL;
+}
+
+void CurveView::paintEvent(QPaintEvent *)
+{
+	QPainter painter(this);
+	painter.fillRect(rect(), palette().base());
+
+	if (!track || rows <= 0 || width() <= 0)
+		return;
+
+	const CurvePyramid *pyramid = getPyramid(track);
+	int start = viewStart;
+	int count = viewRows > 0 ? viewRows : rows;
+	int w = width();
+
+	// one min/max per pixel column, whatever the zoom
+	QVector<float> mins(w), maxs(w);
+	float min = FLT_MAX, max = -FLT_MAX;
+	for (int x = 0; x < w; ++x) {
+		int first = start + int(qint64(x) * count / w);
+		int last = qMax(first, start + int(qint64(x + 1) * count / w) - 1);
+		pyramid->getRange(track, first, last, &mins[x], &maxs[x]);
+		min = qMin(min, mins[x]);
+		max = qMax(max, maxs[x]);
+	}
+
+	if (max - min < 1e-6f) {
+		min -= 0.5f;
+		max += 0.5f;
+	}
+
+	const int margin = 4;
+	float scale = (height() - 1 - 2 * margin) / (max - min);
+
+	painter.setPen(palette().color(QPalette::Text));
+	for (int x = 0; x < w; ++x) {
+		float lo = mins[x], hi = maxs[x];
+
+		// close the gap to the previous column, so steps stay connected
+		if (x > 0) {
+			lo = qMin(lo, maxs[x - 1]);
+			hi = qMax(hi, mins[x - 1]);
+		}
+
+		int top = height() - 1 - margin - int((hi - min) * scale);
+		int bottom = height() - 1 - margin - int((lo - min) * scale);
+		painter.drawLine(x, top, x, bottom);
+	}
+
+	if (row >= start && row < start + count) {
+		int x = int(qint64(row - start) * w / count);
+		painter.setPen(palette().color(QPalette::Highlight));
+		painter.drawLine(x, 0, x, height() - 1);
+	}
+
+	painter.setPen(palette().color(QPalette::Text));
+	painter.drawText(rect().adjusted(margin, margin, -margin, -margin),
+	                 Qt::AlignLeft | Qt::AlignTop,
+	                 QString("%1 [%2, %3]").arg(track->getDisplayName())
+	                 .arg(min, 0, 'f', 2).arg(max, 0, 'f', 2));
+}
+
+void CurveView::wheelEvent(QWheelEvent *event)
+{
+	if (rows <= 0 || width() <= 0)
+		return;
+
+	int count = viewRows > 0 ? viewRows : rows;
+#if QT_VERSION >= QT_VERSION_CHECK(5, 14, 0)
+	int x = int(event->position().x());
+#else
+	int x = event->pos().x();
+#endif
+	int anchor = viewStart + int(qint64(x) * count / width());
+
+	int newCount = event->angleDelta().y() > 0 ? count / 2 : count * 2;
+	newCount = qBound(qMin(rows, 16), newCount, rows);
+
+	// zoom around the row under the mouse
+	viewStart = anchor - int(qint64(anchor - viewStart) * newCount / count);
+	viewStart = qBound(0, viewStart, rows - newCount);
+	viewRows = newCount < rows ? newCount : 0;
+	update();
+}
@@ -0,0 +1,64 @@
+#ifndef CURVEVIEW_H
+#define CURVEVIEW_H
+
+#include <QHash>
+#include <QVector>
+#include <QWidget>
+
+#include "synctrack.h"
+
+/*
+ * Min/max of a track's values over blocks of rows, halving the resolution
+ * for every level. Every interpolation type is monotonic between two keys,
+ * so a block's extremes are found among the values at its ends and on
+ * either side of the keys inside it.
+ */
+class CurvePyramid {
+public:
+	enum { BLOCK_ROWS = 16 };
+
+	void rebuild(const SyncTrack *track, int rows);
+	void update(const SyncTrack *track, int start, int stop);
+
+	// extremes over exactly [start, stop]
+	void getRange(const SyncTrack *track, int start, int stop, float *min, float *max) const;
+
+private:
+	void updateBlock(const SyncTrack *track, int block);
+
+	int rows;
+	QVector<QVector<float> > mins, maxs;
+};
+
+class CurveView : public QWidget {
+	Q_OBJECT
+public:
+	explicit CurveView(QWidget *parent = NULL);
+	~CurveView();
+
+	void setTrack(SyncTrack *track);
+	void setRows(int rows);
+	void setRow(int row);
+
+	QSize sizeHint() const { return QSize(400, 150); }
+
+private slots:
+	void onKeysChanged(const SyncTrack::KeyChanges &changes);
+	void onTrackDestroyed(QObject *track);
+
+private:
+	void paintEvent(QPaintEvent *);
+	void wheelEvent(QWheelEvent *);
+
+	CurvePyramid *getPyramid(SyncTrack *track);
+	void clearPyramids();
+
+	QHash<SyncTrack *, CurvePyramid *> pyramids;
+	SyncTrack *track;
+	int rows, row;
+
+	/* visible window, in rows */
+	int viewStart, viewRows;
+};
+
+#endif // !defined(CURVEVIEW_H)
@@ -2,24 +2,44 @@ TEMPLATE = app
 TARGET = editor
 DEPENDPATH += .
 
-QT = core gui xml network widgets
+QT = core gui network widgets concurrent
 
 qtHaveModule(websockets): QT += websockets
 
 !contains(QT, websockets): message("QWebSockets module not found, disabling websocket support...")
 
+# zlib, as bundled with Qt on Windows and from the system elsewhere
+win32: INCLUDEPATH += $$[QT_INSTALL_HEADERS]/QtZlib
+else: LIBS += -lz
+
+unix {
+    DEFINES += USE_SHM
+    HEADERS += shmserver.h
+    SOURCES += shmserver.cpp
+    linux: LIBS += -lrt
+}
+
 # Input
 HEADERS += syncclient.h \
+    curveview.h \
+    gzipdevice.h \
+    keyblock.h \
     mainwindow.h \
     syncdocument.h \
+    syncjournal.h \
     synctrack.h \
     trackview.h \
     syncpage.h
 
 SOURCES += syncclient.cpp \
+    curveview.cpp \
     editor.cpp \
+    gzipdevice.cpp \
+    keyblock.cpp \
     mainwindow.cpp \
     syncdocument.cpp \
+    syncdocumentbinary.cpp \
+    syncjournal.cpp \
     trackview.cpp \
     syncpage.cpp
 
@@ -0,0 +1,140 @@
+#include "gzipdevice.h"
+
+#include <zlib.h>
+#include <string.h>
+
+enum {
+	CHUNK_SIZE = 64 * 1024,
+	GZIP_WINDOW_BITS = 15 + 16 // the largest window, with a gzip header
+};
+
+GzipDevice::GzipDevice(QIODevice *device, QObject *parent) :
+    QIODevice(parent),
+    device(device),
+    stream(new z_stream),
+    streamEnd(false),
+    failed(false)
+{
+	memset(stream, 0, sizeof(*stream));
+}
+
+GzipDevice::~GzipDevice()
+{
+	close();
+	delete stream;
+}
+
+bool GzipDevice::open(OpenMode mode)
+{
+	bool reading = (mode & ReadOnly) != 0;
+	if (reading == ((mode & WriteOnly) != 0)) {
+		setErrorString("Compressed files open for either reading or writing");
+		return false;
+	}
+
+	memset(stream, 0, sizeof(*stream));
+	int ret = reading ? inflateInit2(stream, GZIP_WINDOW_BITS) :
+	          deflateInit2(stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+	                       GZIP_WINDOW_BITS, 8, Z_DEFAULT_STRATEGY);
+	if (ret != Z_OK) {
+		setErrorString(stream->msg ? QString::fromLatin1(stream->msg) : QString("zlib failed to start"));
+		return false;
+	}
+
+	buffer.resize(CHUNK_SIZE);
+	pending.clear();
+	streamEnd = failed = false;
+	return QIODevice::open(mode | Unbuffered);
+}
+
+void GzipDevice::close()
+{
+	if (!isOpen())
+		return;
+
+	if (openMode() & WriteOnly) {
+		if (!failed)
+			deflateBuffer(Z_FINISH);
+		deflateEnd(stream);
+	} else {
+		inflateEnd(stream);
+	}
+	QIODevice::close();
+}
+
+void GzipDevice::setFailed(const QString &error)
+{
+	failed = true;
+	setErrorString(error);
+}
+
+qint64 GzipDevice::readData(char *data, qint64 maxSize)
+{
+	if (failed)
+		return -1;
+
+	stream->next_out = reinterpret_cast<Bytef *>(data);
+	stream->avail_out = uInt(qMin(maxSize, qint64(CHUNK_SIZE)));
+	uInt wanted = stream->avail_out;
+
+	while (stream->avail_out > 0 && !streamEnd) {
+		if (!stream->avail_in) {
+			qint64 size = device->read(buffer.data(), buffer.size());
+			if (size <= 0) {
+				setFailed(size < 0 ? device->errorString() : QString("Truncated compressed data"));
+				break;
+			}
+			stream->next_in = reinterpret_cast<Bytef *>(buffer.data());
+			stream->avail_in = uInt(size);
+		}
+
+		int ret = inflate(stream, Z_NO_FLUSH);
+		if (ret == Z_STREAM_END) {
+			streamEnd = true;
+		} else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+			setFailed(stream->msg ? QString::fromLatin1(stream->msg) : QString("Corrupt compressed data"));
+			break;
+		}
+	}
+
+	qint64 size = wanted - stream->avail_out;
+	if (!size && (streamEnd || failed))
+		return -1;
+	return size;
+}
+
+qint64 GzipDevice::writeData(const char *data, qint64 maxSize)
+{
+	if (failed)
+		return -1;
+
+	// the XML writer hands over a few bytes at a time
+	pending.append(data, int(maxSize));
+	if (pending.size() >= CHUNK_SIZE && !deflateBuffer(Z_NO_FLUSH))
+		return -1;
+	return maxSize;
+}
+
+bool GzipDevice::deflateBuffer(int flush)
+{
+	stream->next_in = reinterpret_cast<Bytef *>(pending.data());
+	stream->avail_in = uInt(pending.size());
+
+	do {
+		stream->next_out = reinterpret_cast<Bytef *>(buffer.data());
+		stream->avail_out = uInt(buffer.size());
+		if (deflate(stream, flush) == Z_STREAM_ERROR) {
+			setFailed("zlib failed to compress");
+			return false;
+		}
+
+		qint64 size = buffer.size() - stream->avail_out;
+		if (size && device->write(buffer.constData(), size) != size) {
+			setFailed(device->errorString());
+			return false;
+		}
+	} while (!stream->avail_out);
+
+	pending.clear();
+	return true;
+}
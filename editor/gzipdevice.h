@@ -0,0 +1,47 @@
+#ifndef GZIPDEVICE_H
+#define GZIPDEVICE_H
+
+#include <QByteArray>
+#include <QIODevice>
+
+struct z_stream_s;
+
+/*
+ * Reads or writes a gzip stream through another device, a buffer at a
+ * time, so neither side ever holds the whole uncompressed data. Opened
+ * for one direction only; close() writes the end of the stream.
+ */
+class GzipDevice : public QIODevice {
+	Q_OBJECT
+public:
+	explicit GzipDevice(QIODevice *device, QObject *parent = NULL);
+	~GzipDevice();
+
+	/* by the magic bytes, without consuming anything */
+	static bool isGzip(QIODevice *device)
+	{
+		return device->peek(2) == QByteArray("\x1f\x8b", 2);
+	}
+
+	bool isSequential() const { return true; }
+	bool open(OpenMode mode);
+	void close();
+
+	bool hasError() const { return failed; }
+
+protected:
+	qint64 readData(char *data, qint64 maxSize);
+	qint64 writeData(const char *data, qint64 maxSize);
+
+private:
+	bool deflateBuffer(int flush);
+	void setFailed(const QString &error);
+
+	QIODevice *device;
+	z_stream_s *stream;
+	QByteArray buffer;  // compressed data, on its way in or out
+	QByteArray pending; // uncompressed data, not yet handed to zlib
+	bool streamEnd, failed;
+};
+
+#endif // !defined(GZIPDEVICE_H)
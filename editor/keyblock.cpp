@@ -0,0 +1,113 @@
+#include "keyblock.h"
+#include <QtEndian>
+
+/*
+ * Clipboard layout, all integers as LEB128 varints: the width and height
+ * of the block, then for each of its columns the number of keys, followed
+ * by each key as the row delta to the previous key (or to the top of the
+ * block), the interpolation type, and the value as little-endian float bits.
+ */
+static void putVarint(QByteArray &data, quint32 v)
+{
+	while (v >= 0x80) {
+		data.append(char(v | 0x80));
+		v >>= 7;
+	}
+	data.append(char(v));
+}
+
+static bool getVarint(const QByteArray &data, int &pos, quint32 *v)
+{
+	*v = 0;
+	for (int shift = 0; shift < 35; shift += 7) {
+		if (pos >= data.size())
+			return false;
+		uchar b = uchar(data.at(pos++));
+		if (shift == 28 && (b & 0xf0))
+			return false; // more than 32 bits
+		*v |= quint32(b & 0x7f) << shift;
+		if (!(b & 0x80))
+			return true;
+	}
+	return false;
+}
+
+QByteArray encodeKeyBlock(const QVector<QVector<SyncTrack::TrackKey> > &columns, int top, int height)
+{
+	QByteArray data;
+	putVarint(data, columns.size());
+	putVarint(data, height);
+	for (int i = 0; i < columns.size(); ++i) {
+		const QVector<SyncTrack::TrackKey> &keys = columns[i];
+		putVarint(data, keys.size());
+
+		int prevRow = top;
+		for (int j = 0; j < keys.size(); ++j) {
+			union {
+				float f;
+				quint32 i;
+			} v;
+			v.f = keys[j].value;
+			uchar bits[4];
+			qToLittleEndian(v.i, bits);
+
+			putVarint(data, keys[j].row - prevRow);
+			data.append(char(keys[j].type));
+			data.append(reinterpret_cast<const char *>(bits), 4);
+			prevRow = keys[j].row;
+		}
+	}
+	return data;
+}
+
+bool decodeKeyBlock(const QByteArray &data, int maxHeight,
+                    QVector<QVector<SyncTrack::TrackKey> > *columns, int *height)
+{
+	int pos = 0;
+	quint32 width, rows;
+	if (!getVarint(data, pos, &width) || !getVarint(data, pos, &rows) ||
+	    width > quint32(data.size()) || rows > quint32(qMax(maxHeight, 0)))
+		return false;
+
+	columns->resize(width);
+	for (quint32 i = 0; i < width; ++i) {
+		quint32 count;
+		if (!getVarint(data, pos, &count) || count > quint32(data.size() - pos) / 6)
+			return false;
+
+		QVector<SyncTrack::TrackKey> &keys = (*columns)[i];
+		keys.reserve(count);
+		quint32 row = 0;
+		for (quint32 j = 0; j < count; ++j) {
+			quint32 delta;
+			if (!getVarint(data, pos, &delta) || pos + 5 > data.size())
+				return false;
+
+			// strictly increasing after the first, and inside the block;
+			// checked before adding, so a huge delta can't wrap around
+			if ((j && !delta) || delta >= rows - row)
+				return false;
+			row += delta;
+
+			uchar type = uchar(data.at(pos++));
+			if (type >= SyncTrack::TrackKey::KEY_TYPE_COUNT)
+				return false;
+
+			union {
+				float f;
+				quint32 i;
+			} v;
+			v.i = qFromLittleEndian<quint32>(reinterpret_cast<const uchar *>(data.constData() + pos));
+			pos += 4;
+
+			SyncTrack::TrackKey key;
+			key.row = int(row);
+			key.value = v.f;
+			key.type = SyncTrack::TrackKey::KeyType(type);
+			keys.append(key);
+		}
+	}
+
+	*height = int(rows);
+	return pos == data.size();
+}
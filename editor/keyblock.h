@@ -0,0 +1,19 @@
+#ifndef KEYBLOCK_H
+#define KEYBLOCK_H
+
+#include <QByteArray>
+#include <QVector>
+#include "synctrack.h"
+
+/*
+ * The keys of a block of rows over a few tracks, as they go on the
+ * clipboard. Rows are stored relative to the top of the block.
+ */
+QByteArray encodeKeyBlock(const QVector<QVector<SyncTrack::TrackKey> > &columns, int top, int height);
+
+/* rows come back relative to the top of the block; false if malformed,
+ * or if the block is more than maxHeight rows tall */
+bool decodeKeyBlock(const QByteArray &data, int maxHeight,
+                    QVector<QVector<SyncTrack::TrackKey> > *columns, int *height);
+
+#endif // !defined(KEYBLOCK_H)
@@ -1,9 +1,11 @@
 #include "mainwindow.h"
+#include "curveview.h"
 #include "trackview.h"
 #include "syncclient.h"
 #include "syncdocument.h"
 
 #include <QApplication>
+#include <QDockWidget>
 #include <QMenuBar>
 #include <QStatusBar>
 #include <QLabel>
@@ -12,10 +14,14 @@
 #include <QFontDialog>
 #include <QSettings>
 #include <QMessageBox>
+#include <QProgressBar>
 #include <QFileDialog>
 #include <QInputDialog>
+#include <QSet>
 #include <QTabWidget>
 #include <QTcpServer>
+#include <QTimer>
+#include <QVBoxLayout>
 #include <QtEndian>
 
 #ifdef QT_WEBSOCKETS_LIB
@@ -23,15 +29,34 @@
 #include <QWebSocket>
 #endif
 
+#ifdef USE_SHM
+#include "shmserver.h"
+#endif
+
 MainWindow::MainWindow() :
 	QMainWindow(),
 #ifdef Q_OS_WIN32
 	settings("HKEY_CURRENT_USER\\Software\\GNU Rocket", QSettings::NativeFormat),
 #endif
-	syncClient(NULL),
+	leader(NULL),
 	doc(NULL),
-	currentTrackView(NULL)
-{
+	currentRow(0),
+	currentTrackView(NULL),
+	paused(true),
+	saving(false),
+	savingAs(false)
+{
+	syncClients = new SyncClientGroup(this);
+
+	// rows go back and forth at most this often, in ms; 0 for every one
+	int rowSyncInterval = settings.value("rowSyncInterval", 16).toInt();
+	editRowSync = new RowCoalescer(this);
+	editRowSync->setInterval(rowSyncInterval);
+	connect(editRowSync, SIGNAL(rowReady(int)), this, SLOT(sendEditRow(int)));
+	clientRowSync = new RowCoalescer(this);
+	clientRowSync->setInterval(rowSyncInterval);
+	connect(clientRowSync, SIGNAL(rowReady(int)), this, SLOT(applyClientRow(int)));
+
 #ifdef Q_OS_WIN
 	trackViewFont = QFont("Consolas", 11);
 #elif defined(Q_OS_OSX)
@@ -52,6 +77,12 @@ MainWindow::MainWindow() :
 
 	setCentralWidget(tabWidget);
 
+	curveView = new CurveView;
+	curveDock = new QDockWidget("Curve", this);
+	curveDock->setObjectName("curveDock");
+	curveDock->setWidget(curveView);
+	addDockWidget(Qt::BottomDockWidgetArea, curveDock);
+
 	createMenuBar();
 	updateRecentFiles();
 
@@ -72,6 +103,15 @@ MainWindow::MainWindow() :
 	if (!wsServer->listen(QHostAddress::Any, 1339))
 		statusBar()->showMessage(QString("Could not start server: %1").arg(wsServer->errorString()));
 #endif
+
+#ifdef USE_SHM
+	shmServer = new ShmServer();
+	connect(shmServer, SIGNAL(newConnection()),
+	        this, SLOT(onNewShmConnection()));
+
+	if (!shmServer->listen("/rocket-1338"))
+		statusBar()->showMessage(QString("Could not start server: %1").arg(shmServer->errorString()));
+#endif
 }
 
 void MainWindow::showEvent(QShowEvent *event)
@@ -113,8 +153,8 @@ void MainWindow::keyPressEvent(QKeyEvent *event)
 		break;
 
 	case Qt::Key_Space:
-		if (syncClient) {
-			setPaused(!syncClient->isPaused());
+		if (leader) {
+			setPaused(!paused);
 			return;
 		}
 		break;
@@ -161,6 +201,19 @@ void MainWindow::createMenuBar()
 	editMenu->addSeparator();
 	editMenu->addAction("Previous Bookmark", this, SLOT(editPreviousBookmark()), Qt::ALT + Qt::Key_PageUp);
 	editMenu->addAction("Next Bookmark", this, SLOT(editNextBookmark()), Qt::ALT + Qt::Key_PageDown);
+
+	QMenu *viewMenu = menuBar()->addMenu("&View");
+	viewMenu->addAction(curveDock->toggleViewAction());
+
+	QMenu *connectionMenu = menuBar()->addMenu("&Connection");
+	leaderMenu = connectionMenu->addMenu("&Leader");
+	connect(leaderMenu, SIGNAL(aboutToShow()),
+	        this, SLOT(onLeaderMenuAboutToShow()));
+	newestClientLeadsAction = connectionMenu->addAction("&Newest Client Leads");
+	newestClientLeadsAction->setCheckable(true);
+	newestClientLeadsAction->setChecked(settings.value("newestClientLeads", false).toBool());
+	connect(newestClientLeadsAction, SIGNAL(toggled(bool)),
+	        this, SLOT(onNewestClientLeads(bool)));
 }
 
 void MainWindow::createStatusBar()
@@ -168,11 +221,31 @@ void MainWindow::createStatusBar()
 	statusPos = new QLabel;
 	statusValue = new QLabel;
 	statusKeyType = new QLabel;
-
+	statusStats = new QLabel;
+
+	// only while a save runs in the background
+	saveProgress = new QProgressBar;
+	saveProgress->setMaximumWidth(120);
+	saveProgress->hide();
+	statusBar()->addPermanentWidget(saveProgress);
+
+	saveWatcher = new QFutureWatcher<QString>(this);
+	connect(saveWatcher, SIGNAL(progressRangeChanged(int, int)),
+	        saveProgress, SLOT(setRange(int, int)));
+	connect(saveWatcher, SIGNAL(progressValueChanged(int)),
+	        saveProgress, SLOT(setValue(int)));
+	connect(saveWatcher, SIGNAL(finished()),
+	        this, SLOT(onSaveFinished()));
+
+	statusBar()->addPermanentWidget(statusStats);
 	statusBar()->addPermanentWidget(statusPos);
 	statusBar()->addPermanentWidget(statusValue);
 	statusBar()->addPermanentWidget(statusKeyType);
 
+	statsTimer = new QTimer(this);
+	connect(statsTimer, SIGNAL(timeout()), this, SLOT(onStatsTimer()));
+	statsTimer->start(1000);
+
 	statusBar()->setSizePolicy(QSizePolicy::Minimum, QSizePolicy::Fixed);
 
 	statusBar()->showMessage("Not connected");
@@ -247,6 +320,8 @@ void MainWindow::setCurrentFileName(const QString &fileName)
 
 void MainWindow::setDocument(SyncDocument *newDoc)
 {
+	waitForSave();
+
 	if (doc) {
 		QObject::disconnect(doc, SIGNAL(syncPageAdded(SyncPage *)),
 		                    this, SLOT(onSyncPageAdded(SyncPage *)));
@@ -254,70 +329,75 @@ void MainWindow::setDocument(SyncDocument *newDoc)
 		                    this, SLOT(setWindowModified(bool)));
 	}
 
-	if (doc && syncClient) {
+	// the key frames are about to go, but not because anyone deleted them
+	if (doc)
+		doc->closeJournal();
+
+	if (doc && !syncClients->isEmpty()) {
 		// delete old key frames
 		for (int i = 0; i < doc->getTrackCount(); ++i) {
 			SyncTrack *t = doc->getTrack(i);
-			QMap<int, SyncTrack::TrackKey> keyMap = t->getKeyMap();
-			QMap<int, SyncTrack::TrackKey>::const_iterator it;
-			for (it = keyMap.constBegin(); it != keyMap.constEnd(); ++it)
-				t->removeKey(it.key());
-
-			QObject::disconnect(t, SIGNAL(keyFrameAdded(int)),
-			                    syncClient, SLOT(onKeyFrameAdded(int)));
-			QObject::disconnect(t, SIGNAL(keyFrameChanged(int, const SyncTrack::TrackKey &)),
-			                    syncClient, SLOT(onKeyFrameChanged(int, const SyncTrack::TrackKey &)));
-			QObject::disconnect(t, SIGNAL(keyFrameRemoved(int, const SyncTrack::TrackKey &)),
-			                    syncClient, SLOT(onKeyFrameRemoved(int, const SyncTrack::TrackKey &)));
+			t->beginBatch();
+			while (t->getKeyCount() > 0)
+				t->removeKey((t->end() - 1)->row);
+			t->endBatch();
+
+			syncClients->disconnectTrack(t);
 		}
 
 		if (newDoc) {
 			// add back missing client-tracks
-			QStringList trackNames = syncClient->getTrackNames();
-			for (int i = 0; i < trackNames.size(); ++i) {
-				SyncTrack *t = newDoc->findTrack(trackNames[i]);
-				if (!t)
-					t = newDoc->createTrack(trackNames[i]);
-				t->setActive(true);
+			QList<SyncClient *> clients = syncClients->getClients();
+			for (int i = 0; i < clients.size(); ++i) {
+				QStringList trackNames = clients[i]->getTrackNames();
+				for (int j = 0; j < trackNames.size(); ++j) {
+					SyncTrack *t = newDoc->findTrack(trackNames[j]);
+					if (!t)
+						t = newDoc->createTrack(trackNames[j]);
+					t->setActive(true);
+				}
 			}
 
 			for (int i = 0; i < newDoc->getTrackCount(); ++i) {
 				SyncTrack *t = newDoc->getTrack(i);
-				QMap<int, SyncTrack::TrackKey> keyMap = t->getKeyMap();
-				QMap<int, SyncTrack::TrackKey>::const_iterator it;
-				for (it = keyMap.constBegin(); it != keyMap.constEnd(); ++it)
-					syncClient->sendSetKeyCommand(t->getName(), *it);
-
-				QObject::connect(t, SIGNAL(keyFrameAdded(int)),
-				                 syncClient, SLOT(onKeyFrameAdded(int)));
-				QObject::connect(t, SIGNAL(keyFrameChanged(int, const SyncTrack::TrackKey &)),
-				                 syncClient, SLOT(onKeyFrameChanged(int, const SyncTrack::TrackKey &)));
-				QObject::connect(t, SIGNAL(keyFrameRemoved(int, const SyncTrack::TrackKey &)),
-				                 syncClient, SLOT(onKeyFrameRemoved(int, const SyncTrack::TrackKey &)));
+				sendTrackKeys(clients, t);
+				syncClients->connectTrack(t);
 			}
 		}
 	}
 
-	// recreate empty set of trackViews
-	while (trackViews.count() > 0) {
-		TrackView *trackView = trackViews.front();
+	// recreate empty set of tabs; without signals, or every old page
+	// would get a view on its way out as it becomes current
+	onTabChanged(-1);
+	tabWidget->blockSignals(true);
+	while (tabWidget->count() > 0) {
+		QWidget *tab = tabWidget->widget(0);
+		tabPages.removeFirst();
 		trackViews.removeFirst();
-		delete trackView;
+		delete tab;
 	}
-	trackViews.clear();
 
 	for (int i = 0; i < newDoc->getSyncPageCount(); ++i)
-		addTrackView(newDoc->getSyncPage(i));
+		addPageTab(newDoc->getSyncPage(i));
+	tabWidget->blockSignals(false);
+	onTabChanged(tabWidget->currentIndex());
 
 	if (doc)
 		delete doc;
 	doc = newDoc;
 
+	// in MiB
+	doc->setUndoMemoryLimit(qint64(settings.value("undoMemoryLimit", 256).toInt()) << 20);
+
 	QObject::connect(doc, SIGNAL(syncPageAdded(SyncPage *)),
 	                 this, SLOT(onSyncPageAdded(SyncPage *)));
 	QObject::connect(newDoc, SIGNAL(modifiedChanged(bool)),
 	                 this, SLOT(setWindowModified(bool)));
 
+	curveView->setRows(doc->getRows());
+	if (currentTrackView)
+		onPosChanged(currentTrackView->getEditTrack(), currentTrackView->getEditRow());
+
 	onCurrValDirty();
 }
 
@@ -335,6 +415,14 @@ bool MainWindow::loadDocument(const QString &path)
 		setDocument(newDoc);
 		setCurrentFileName(path);
 		setWindowModified(false);
+
+		if (newDoc->hasRecoverableJournal() &&
+		    QMessageBox::question(this, "Rocket",
+		        QString("%1 has unsaved changes from an earlier session. Recover them?").arg(QFileInfo(path).fileName()),
+		        QMessageBox::Yes | QMessageBox::No) == QMessageBox::Yes)
+			newDoc->recoverJournal();
+		else
+			newDoc->startJournal(path);
 		return true;
 	}
 	return false;
@@ -342,7 +430,7 @@ bool MainWindow::loadDocument(const QString &path)
 
 void MainWindow::fileOpen()
 {
-	QString fileName = QFileDialog::getOpenFileName(this, "Open File", "", "ROCKET File (*.rocket);;All Files (*.*)");
+	QString fileName = QFileDialog::getOpenFileName(this, "Open File", "", "ROCKET File (*.rocket);;Compressed ROCKET File (*.rocket.gz);;Binary ROCKET File (*.rocketb);;All Files (*.*)");
 	if (fileName.length()) {
 		loadDocument(fileName);
 	}
@@ -350,16 +438,9 @@ void MainWindow::fileOpen()
 
 void MainWindow::fileSaveAs()
 {
-	QString fileName = QFileDialog::getSaveFileName(this, "Save File", "", "ROCKET File (*.rocket);;All Files (*.*)");
-	if (fileName.length()) {
-		if (doc->save(fileName)) {
-			if (syncClient)
-				syncClient->sendSaveCommand();
-
-			setCurrentFileName(fileName);
-			doc->fileName = fileName;
-		}
-	}
+	QString fileName = QFileDialog::getSaveFileName(this, "Save File", "", "ROCKET File (*.rocket);;Compressed ROCKET File (*.rocket.gz);;Binary ROCKET File (*.rocketb);;All Files (*.*)");
+	if (fileName.length())
+		saveDocument(fileName, true);
 }
 
 void MainWindow::fileSave()
@@ -367,14 +448,73 @@ void MainWindow::fileSave()
 	if (doc->fileName.isEmpty())
 		return fileSaveAs();
 
-	if (!doc->save(doc->fileName))
+	saveDocument(doc->fileName, false);
+}
+
+void MainWindow::saveDocument(const QString &fileName, bool saveAs)
+{
+	if (saving) {
+		statusBar()->showMessage("Still saving, try again in a moment", 2000);
+		return;
+	}
+
+	saveFileName = fileName;
+	savingAs = saveAs;
+
+	// mostly rewritten in place, which is quick enough as it is
+	if (fileName.endsWith(".rocketb", Qt::CaseInsensitive)) {
+		finishSave(doc->save(fileName));
+		return;
+	}
+
+	saving = true;
+	saveProgress->setRange(0, 0);
+	saveProgress->show();
+	statusBar()->showMessage(QString("Saving %1...").arg(QFileInfo(fileName).fileName()));
+	saveWatcher->setFuture(doc->saveInBackground(fileName));
+}
+
+void MainWindow::waitForSave()
+{
+	if (saving) {
+		saveWatcher->waitForFinished();
+		onSaveFinished();
+	}
+}
+
+void MainWindow::onSaveFinished()
+{
+	// already handled by waitForSave()
+	if (!saving)
+		return;
+
+	saving = false;
+	saveProgress->hide();
+	statusBar()->clearMessage();
+
+	QString error = saveWatcher->result();
+	doc->saveFinished(saveFileName, error.isEmpty());
+	if (!error.isEmpty())
+		QMessageBox::critical(this, "Error", error);
+	finishSave(error.isEmpty());
+}
+
+void MainWindow::finishSave(bool ok)
+{
+	if (ok && savingAs) {
+		for (int i = 0; i < syncClients->getClients().size(); ++i)
+			syncClients->getClients()[i]->sendSaveCommand();
+
+		setCurrentFileName(saveFileName);
+		doc->fileName = saveFileName;
+	} else if (!ok && !savingAs)
 		fileRemoteExport();
 }
 
 void MainWindow::fileRemoteExport()
 {
-	if (syncClient)
-		syncClient->sendSaveCommand();
+	for (int i = 0; i < syncClients->getClients().size(); ++i)
+		syncClients->getClients()[i]->sendSaveCommand();
 }
 
 void MainWindow::openRecentFile()
@@ -399,11 +539,18 @@ void MainWindow::fileQuit()
 		    QMessageBox::Yes | QMessageBox::No | QMessageBox::Cancel);
 		if (res == QMessageBox::Yes) {
 			fileSave();
+			waitForSave();
+			if (!doc->isModified())
+				doc->discardJournal();
 			QApplication::quit();
-		} else if (res == QMessageBox::No)
+		} else if (res == QMessageBox::No) {
+			doc->discardJournal();
 			QApplication::quit();
+		}
+	} else {
+		doc->discardJournal();
+		QApplication::quit();
 	}
-	else QApplication::quit();
 }
 
 void MainWindow::editUndo()
@@ -465,8 +612,10 @@ void MainWindow::editSetRows()
 	int rows = QInputDialog::getInt(this, "Set Rows", "", currentTrackView->getRows(), 0, INT_MAX, 1, &ok);
 	if (ok) {
 		for (int i = 0; i < trackViews.size(); ++i)
-			trackViews[i]->setRows(rows);
+			if (trackViews[i])
+				trackViews[i]->setRows(rows);
 		doc->setRows(rows);
+		curveView->setRows(rows);
 	}
 }
 
@@ -475,8 +624,10 @@ void MainWindow::editSetFont()
 	bool ok = false;
 	QFont font = QFontDialog::getFont(&ok, trackViewFont, this);
 	if (ok) {
+		trackViewFont = font;
 		for (int i = 0; i < trackViews.size(); ++i)
-			trackViews[i]->setFont(font);
+			if (trackViews[i])
+				trackViews[i]->setFont(font);
 		settings.setValue("font", font.toString());
 	}
 }
@@ -494,17 +645,25 @@ void MainWindow::editNextBookmark()
 void MainWindow::onPosChanged(int col, int row)
 {
 	statusPos->setText(QString("Row %1, Col %2").arg(row).arg(col));
+
+	if (currentTrackView && col < currentTrackView->getTrackCount())
+		curveView->setTrack(currentTrackView->getTrack(col));
+	else
+		curveView->setTrack(NULL);
+	curveView->setRow(row);
 }
 
 void MainWindow::onEditRowChanged(int row)
 {
-	if (syncClient)
-		syncClient->sendSetRowCommand(row);
+	// only the current view has moved; the others follow when shown
+	currentRow = row;
+	editRowSync->setRow(row);
+}
 
-	for (int i = 0; i < trackViews.size(); ++i) {
-		if (trackViews[i] != QObject::sender())
-			trackViews[i]->updateRow(row);
-	}
+void MainWindow::sendEditRow(int row)
+{
+	for (int i = 0; i < syncClients->getClients().size(); ++i)
+		syncClients->getClients()[i]->sendSetRowCommand(row);
 }
 
 void MainWindow::onCurrValDirty()
@@ -532,20 +691,35 @@ void MainWindow::onCurrValDirty()
 	}
 }
 
-TrackView *MainWindow::addTrackView(SyncPage *page)
+void MainWindow::addPageTab(SyncPage *page)
 {
-	TrackView *trackView = new TrackView(page, NULL);
-	trackView->setFont(trackViewFont);
+	QWidget *tab = new QWidget;
+	QVBoxLayout *layout = new QVBoxLayout(tab);
+	layout->setContentsMargins(0, 0, 0, 0);
 
-	trackViews.append(trackView);
-	tabWidget->addTab(trackView, page->getName());
+	tabPages.append(page);
+	trackViews.append(NULL);
+	tabWidget->addTab(tab, page->getName());
+}
 
+TrackView *MainWindow::getTrackView(int index)
+{
+	TrackView *trackView = trackViews[index];
+	if (!trackView) {
+		QWidget *tab = tabWidget->widget(index);
+		trackView = new TrackView(tabPages[index], tab);
+		trackView->setFont(trackViewFont);
+		trackView->setReadOnly(!paused);
+		tab->layout()->addWidget(trackView);
+		trackView->show();
+		trackViews[index] = trackView;
+	}
 	return trackView;
 }
 
 void MainWindow::onSyncPageAdded(SyncPage *page)
 {
-	addTrackView(page);
+	addPageTab(page);
 }
 
 void MainWindow::onTabChanged(int index)
@@ -555,12 +729,13 @@ void MainWindow::onTabChanged(int index)
 	if (currentTrackView != NULL) {
 		disconnect(posChangedConnection);
 		disconnect(editRowChangedConnection);
-		disconnect(editRowChangedConnection);
+		disconnect(currValDirtyConnection);
 		currentTrackView = NULL;
 	}
 
 	if (index >= 0) {
-		currentTrackView = trackViews[index];
+		currentTrackView = getTrackView(index);
+		currentTrackView->updateRow(currentRow);
 
 		posChangedConnection = connect(
 			currentTrackView, SIGNAL(posChanged(int, int)),
@@ -578,84 +753,141 @@ void MainWindow::onTabChanged(int index)
 
 void MainWindow::onTrackRequested(const QString &trackName)
 {
+	SyncClient *client = qobject_cast<SyncClient *>(sender());
+
 	// find track
 	SyncTrack *t = doc->findTrack(trackName.toUtf8());
 	if (!t)
 		t = doc->createTrack(trackName);
 
-	// hook up signals to slots
-	QObject::connect(t, SIGNAL(keyFrameAdded(int)),
-	                 syncClient, SLOT(onKeyFrameAdded(int)));
-	QObject::connect(t, SIGNAL(keyFrameChanged(int, const SyncTrack::TrackKey &)),
-	                 syncClient, SLOT(onKeyFrameChanged(int, const SyncTrack::TrackKey &)));
-	QObject::connect(t, SIGNAL(keyFrameRemoved(int, const SyncTrack::TrackKey &)),
-	                 syncClient, SLOT(onKeyFrameRemoved(int, const SyncTrack::TrackKey &)));
+	// edits go out to every client that knows the track
+	syncClients->connectTrack(t);
 
 	// send key frames
-	QMap<int, SyncTrack::TrackKey> keyMap = t->getKeyMap();
-	QMap<int, SyncTrack::TrackKey>::const_iterator it;
-	for (it = keyMap.constBegin(); it != keyMap.constEnd(); ++it)
-		syncClient->sendSetKeyCommand(t->getName(), *it);
+	sendTrackKeys(QList<SyncClient *>() << client, t);
 
 	t->setActive(true);
 }
 
+void MainWindow::sendTrackKeys(const QList<SyncClient *> &clients, const SyncTrack *t)
+{
+	for (SyncTrack::const_iterator it = t->begin(); it != t->end(); ++it) {
+		QByteArray payload = SyncClient::encodeSetKey(*it);
+		for (int i = 0; i < clients.size(); ++i)
+			clients[i]->sendTrackCommand(SET_KEY, t->getName(), payload);
+	}
+}
+
+void MainWindow::updateActiveTracks()
+{
+	QSet<QString> names;
+	for (int i = 0; i < syncClients->getClients().size(); ++i) {
+		QStringList trackNames = syncClients->getClients()[i]->getTrackNames();
+		for (int j = 0; j < trackNames.size(); ++j)
+			names.insert(trackNames[j]);
+	}
+
+	for (int i = 0; i < doc->getTrackCount(); ++i) {
+		SyncTrack *t = doc->getTrack(i);
+		t->setActive(names.contains(t->getName()));
+	}
+}
+
 void MainWindow::onClientRowChanged(int row)
 {
-	for (int i = 0; i < trackViews.count(); ++i)
-		trackViews[i]->updateRow(row);
+	// only the leader gets to move the others around
+	if (QObject::sender() != leader)
+		return;
+
+	clientRowSync->setRow(row);
+}
+
+void MainWindow::applyClientRow(int row)
+{
+	currentRow = row;
+	if (currentTrackView)
+		currentTrackView->updateRow(row);
+
+	QList<SyncClient *> clients = syncClients->getClients();
+	for (int i = 0; i < clients.size(); ++i) {
+		if (clients[i] != leader)
+			clients[i]->sendSetRowCommand(row);
+	}
 }
 
 void MainWindow::setPaused(bool pause)
 {
-	if (syncClient)
-		syncClient->setPaused(pause);
+	paused = pause;
+
+	QList<SyncClient *> clients = syncClients->getClients();
+	for (int i = 0; i < clients.size(); ++i)
+		clients[i]->setPaused(pause);
 
 	for (int i = 0; i < trackViews.count(); ++i)
-		trackViews[i]->setReadOnly(!pause);
+		if (trackViews[i])
+			trackViews[i]->setReadOnly(!pause);
 }
 
-void MainWindow::setSyncClient(SyncClient *client)
+void MainWindow::addSyncClient(SyncClient *client)
 {
-	Q_ASSERT(syncClient == NULL);
 	Q_ASSERT(client != NULL);
 
 	connect(client, SIGNAL(trackRequested(const QString &)), this, SLOT(onTrackRequested(const QString &)));
 	connect(client, SIGNAL(rowChanged(int)), this, SLOT(onClientRowChanged(int)));
 	connect(client, SIGNAL(connected()), this, SLOT(onConnected()));
 	connect(client, SIGNAL(disconnected(const QString &)), this, SLOT(onDisconnected(const QString &)));
-	syncClient = client;
+	syncClients->addClient(client);
+
+	if (!leader || newestClientLeadsAction->isChecked())
+		setLeader(client);
 }
 
-void MainWindow::onNewTcpConnection()
+void MainWindow::setLeader(SyncClient *client)
 {
-	QTcpSocket *pendingSocket = tcpServer->nextPendingConnection();
-	if (!syncClient) {
-		statusBar()->showMessage("Accepting...");
+	leader = client;
+	if (leader && syncClients->getClients().size() > 1)
+		statusBar()->showMessage(QString("Following %1").arg(leader->peerName()));
+}
 
-		QByteArray greeting = QString(CLIENT_GREET).toUtf8();
-		QByteArray response = QString(SERVER_GREET).toUtf8();
+void MainWindow::onLeaderMenuAboutToShow()
+{
+	leaderMenu->clear();
 
-		while (pendingSocket->bytesAvailable() < greeting.length() &&
-				pendingSocket->waitForReadyRead())
-			; // wait until we have the message or got an error
-		QByteArray line = pendingSocket->read(greeting.length());
-		if (line != greeting ||
-		    pendingSocket->write(response) != response.length()) {
-			pendingSocket->close();
+	QList<SyncClient *> clients = syncClients->getClients();
+	if (clients.isEmpty()) {
+		leaderMenu->addAction("No Clients")->setEnabled(false);
+		return;
+	}
 
-			statusBar()->showMessage(QString("Not Connected: %1").arg(tcpServer->errorString()));
-			return;
-		}
+	for (int i = 0; i < clients.size(); ++i) {
+		QAction *action = leaderMenu->addAction(clients[i]->peerName(),
+		                                        this, SLOT(onLeaderSelected()));
+		action->setCheckable(true);
+		action->setChecked(clients[i] == leader);
+		action->setData(i);
+	}
+}
 
-		AbstractSocketClient *client = new AbstractSocketClient(pendingSocket);
-		statusBar()->showMessage(QString("Connected to %1").arg(pendingSocket->peerAddress().toString()));
+void MainWindow::onLeaderSelected()
+{
+	QAction *action = qobject_cast<QAction *>(sender());
+	int index = action->data().toInt();
+	if (index < syncClients->getClients().size())
+		setLeader(syncClients->getClients()[index]);
+}
 
-		setSyncClient(client);
+void MainWindow::onNewestClientLeads(bool enable)
+{
+	settings.setValue("newestClientLeads", enable);
+}
 
-		client->notifyConnected(); // we already performed the hand-shake, unlike the WebSocket client
-	} else
-		pendingSocket->close();
+void MainWindow::onNewTcpConnection()
+{
+	QTcpSocket *pendingSocket = tcpServer->nextPendingConnection();
+	statusBar()->showMessage("Accepting...");
+
+	// the hand-shake happens on the client's own thread
+	addSyncClient(new AbstractSocketClient(pendingSocket));
 }
 
 #ifdef QT_WEBSOCKETS_LIB
@@ -663,48 +895,97 @@ void MainWindow::onNewTcpConnection()
 void MainWindow::onNewWsConnection()
 {
 	QWebSocket *pendingSocket = wsServer->nextPendingConnection();
+	statusBar()->showMessage("Accepting...");
+
+	addSyncClient(new WebSocketClient(pendingSocket));
+}
 
-	if (!syncClient) {
-		statusBar()->showMessage("Accepting...");
+#endif
 
-		SyncClient *client = new WebSocketClient(pendingSocket);
-		statusBar()->showMessage(QString("Connected to %1").arg(pendingSocket->peerAddress().toString()));
+#ifdef USE_SHM
 
-		setSyncClient(client);
-	} else
-		pendingSocket->close();
+void MainWindow::onNewShmConnection()
+{
+	// the segment only ever holds one demo
+	addSyncClient(new ShmClient(shmServer));
 }
 
 #endif
 
 void MainWindow::onConnected()
 {
-	setPaused(true);
-	syncClient->sendSetRowCommand(currentTrackView->getEditRow());
+	SyncClient *client = qobject_cast<SyncClient *>(sender());
+	statusBar()->showMessage(QString("Connected to %1").arg(client->peerName()));
+
+	// the first demo starts out paused, later ones join the others
+	if (syncClients->getClients().size() == 1)
+		setPaused(true);
+	else
+		client->setPaused(paused);
+	client->sendSetRowCommand(currentTrackView->getEditRow());
+}
+
+static QString formatBytes(quint64 bytes)
+{
+	if (bytes < 1024)
+		return QString("%1 B").arg(bytes);
+	if (bytes < 1024 * 1024)
+		return QString("%1 KiB").arg(bytes / 1024.0, 0, 'f', 1);
+	return QString("%1 MiB").arg(bytes / (1024.0 * 1024.0), 0, 'f', 1);
+}
+
+void MainWindow::onStatsTimer()
+{
+	if (!leader) {
+		statusStats->clear();
+		statusStats->setToolTip(QString());
+		return;
+	}
+
+	QList<SyncClient *> clients = syncClients->getClients();
+	for (int i = 0; i < clients.size(); ++i)
+		clients[i]->sendPing();
+
+	const SyncClient::Stats &stats = leader->getStats();
+	QString rtt = stats.rtt < 0 ? QString("---") :
+	              QString("%1 ms").arg(stats.rtt * 1000.0, 0, 'f', 2);
+	QString text = QString("RTT %1, in %2, out %3")
+	               .arg(rtt)
+	               .arg(formatBytes(stats.bytesIn))
+	               .arg(formatBytes(stats.bytesOut));
+	if (clients.size() > 1)
+		text += QString(" (%1 clients)").arg(clients.size());
+	statusStats->setText(text);
+
+	static const char *names[] = {
+		"SET_KEY", "DELETE_KEY", "GET_TRACK", "SET_ROW",
+		"PAUSE", "SAVE_TRACKS", "PING", "PONG"
+	};
+	QString tip = QString("%1\ncommand: in / out").arg(leader->peerName());
+	for (int i = 0; i <= PONG; ++i)
+		tip += QString("\n%1: %2 / %3").arg(names[i])
+		       .arg(stats.commandsIn[i]).arg(stats.commandsOut[i]);
+	statusStats->setToolTip(tip);
 }
 
 void MainWindow::onDisconnected(const QString &error)
 {
-	setPaused(true);
+	SyncClient *client = qobject_cast<SyncClient *>(sender());
 
-	// disconnect track-signals
-	for (int i = 0; i < doc->getTrackCount(); ++i) {
-		SyncTrack *t = doc->getTrack(i);
+	// a dropped client can report in more than once
+	if (!syncClients->getClients().contains(client))
+		return;
 
-		QObject::disconnect(t, SIGNAL(keyFrameAdded(int)),
-		                    syncClient, SLOT(onKeyFrameAdded(int)));
-		QObject::disconnect(t, SIGNAL(keyFrameChanged(int, const SyncTrack::TrackKey &)),
-		                    syncClient, SLOT(onKeyFrameChanged(int, const SyncTrack::TrackKey &)));
-		QObject::disconnect(t, SIGNAL(keyFrameRemoved(int, const SyncTrack::TrackKey &)),
-		                    syncClient, SLOT(onKeyFrameRemoved(int, const SyncTrack::TrackKey &)));
+	syncClients->removeClient(client);
+	client->deleteLater();
 
-		t->setActive(false);
-	}
+	if (client == leader)
+		setLeader(syncClients->isEmpty() ? NULL : syncClients->getClients().last());
 
-	if (syncClient) {
-		delete syncClient;
-		syncClient = NULL;
-	}
+	updateActiveTracks();
+
+	if (syncClients->isEmpty())
+		setPaused(true);
 
 	statusBar()->showMessage("Disconnected: " + error);
 }
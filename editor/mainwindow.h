@@ -1,21 +1,32 @@
 #ifndef MAINWINDOW_H
 #define MAINWINDOW_H
 
+#include <QFutureWatcher>
 #include <QMainWindow>
 #include <QSettings>
 #include <QStringList>
 #include "synctrack.h"
 
 class QLabel;
+class QProgressBar;
 class QAction;
+class QDockWidget;
 class QTabWidget;
 class QTcpServer;
+class QTimer;
 
 #ifdef QT_WEBSOCKETS_LIB
 class QWebSocketServer;
 #endif
 
+#ifdef USE_SHM
+class ShmServer;
+#endif
+
+class CurveView;
 class SyncClient;
+class SyncClientGroup;
+class RowCoalescer;
 class SyncDocument;
 class SyncPage;
 class TrackView;
@@ -40,31 +51,58 @@ public:
 	QSettings settings;
 	QFont trackViewFont;
 
-	TrackView *addTrackView(SyncPage *page);
+	/* a tab per page, but only the ones that have been shown get a view;
+	 * hidden views catch up with the row when shown again */
+	void addPageTab(SyncPage *page);
+	TrackView *getTrackView(int index);
 
 	QTcpServer *tcpServer;
 #ifdef QT_WEBSOCKETS_LIB
 	QWebSocketServer *wsServer;
 #endif
+#ifdef USE_SHM
+	ShmServer *shmServer;
+#endif
 
-	SyncClient *syncClient;
+	SyncClientGroup *syncClients;
+	SyncClient *leader; // drives the row, when the demo is playing
 
 	SyncDocument *doc;
 
 	QTabWidget *tabWidget;
+	QList<SyncPage *> tabPages;
 	QList<TrackView *> trackViews;
+	int currentRow;
+
+	QDockWidget *curveDock;
+	CurveView *curveView;
 
 	TrackView *currentTrackView;
 	QMetaObject::Connection posChangedConnection, editRowChangedConnection,
 	                        currValDirtyConnection;
 
-	QLabel *statusPos, *statusValue, *statusKeyType;
-	QMenu *recentFilesMenu;
+	QLabel *statusPos, *statusValue, *statusKeyType, *statusStats;
+	QTimer *statsTimer;
+	RowCoalescer *editRowSync, *clientRowSync; // one per direction
+	bool paused;
+
+	QFutureWatcher<QString> *saveWatcher;
+	QProgressBar *saveProgress;
+	QString saveFileName;
+	bool saving, savingAs;
+	QMenu *recentFilesMenu, *leaderMenu;
+	QAction *newestClientLeadsAction;
 	QAction *recentFileActions[5];
 
 private:
 	void setPaused(bool pause);
-	void setSyncClient(SyncClient *syncClient);
+	void addSyncClient(SyncClient *client);
+	void setLeader(SyncClient *client);
+	void sendTrackKeys(const QList<SyncClient *> &clients, const SyncTrack *t);
+	void updateActiveTracks();
+	void saveDocument(const QString &fileName, bool saveAs);
+	void waitForSave();
+	void finishSave(bool ok);
 
 public slots:
 	void fileNew();
@@ -76,6 +114,7 @@ private slots:
 	void fileRemoteExport();
 	void openRecentFile();
 	void fileQuit();
+	void onSaveFinished();
 
 	void editBiasSelection();
 
@@ -101,12 +140,21 @@ private slots:
 
 	void onTrackRequested(const QString &trackName);
 	void onClientRowChanged(int row);
+	void sendEditRow(int row);
+	void applyClientRow(int row);
 	void onNewTcpConnection();
 #ifdef QT_WEBSOCKETS_LIB
 	void onNewWsConnection();
+#endif
+#ifdef USE_SHM
+	void onNewShmConnection();
 #endif
 	void onConnected();
 	void onDisconnected(const QString &error);
+	void onStatsTimer();
+	void onLeaderMenuAboutToShow();
+	void onLeaderSelected();
+	void onNewestClientLeads(bool enable);
 
 	void onSyncPageAdded(SyncPage *);
 	void onTabChanged(int index);
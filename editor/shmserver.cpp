@@ -0,0 +1,263 @@
+#include "shmserver.h"
+
+#include <QFile>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#ifdef Q_OS_LINUX
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#endif
+
+static inline quint32 shmLoad(const quint32 *p)
+{
+	return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static inline void shmStore(quint32 *p, quint32 v)
+{
+	__atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+static void ringWake(SyncShmRing *r)
+{
+#ifdef Q_OS_LINUX
+	// head was just published; without a full fence the load of waiting
+	// may be done before it, and miss a reader going to sleep
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (shmLoad(&r->waiting))
+		syscall(SYS_futex, &r->head, FUTEX_WAKE, 1, NULL, NULL, 0);
+#else
+	Q_UNUSED(r);
+#endif
+}
+
+static void ringWait(SyncShmRing *r, quint32 head, int msecs)
+{
+#ifdef Q_OS_LINUX
+	struct timespec to = { 0, msecs * 1000000L };
+	shmStore(&r->waiting, 1);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST); // pairs with the one in ringWake()
+	if (shmLoad(&r->head) == head)
+		syscall(SYS_futex, &r->head, FUTEX_WAIT, head, &to, NULL, 0);
+	shmStore(&r->waiting, 0);
+#else
+	Q_UNUSED(r);
+	Q_UNUSED(head);
+	QThread::msleep(1);
+	Q_UNUSED(msecs);
+#endif
+}
+
+static bool processAlive(quint32 pid)
+{
+	return !pid || kill(pid_t(pid), 0) == 0 || errno == EPERM;
+}
+
+void ShmWatcher::run()
+{
+	SyncShmSegment *seg = server->segment;
+	bool attached = false;
+	quint32 attachedSession = 0;
+
+	while (!stopping.loadAcquire()) {
+		quint32 session = shmLoad(&seg->session);
+		bool live = shmLoad(&seg->state) == SYNC_SHM_CONNECTED &&
+		            processAlive(shmLoad(&seg->client_pid));
+
+		if (attached && (!live || session != attachedSession)) {
+			attached = false;
+			emit clientDetached();
+		} else if (!attached && live) {
+			attached = true;
+			attachedSession = session;
+			emit clientAttached();
+		} else if (!live && shmLoad(&seg->state) == SYNC_SHM_CONNECTED) {
+			// claimed by a demo that died before we noticed it
+			emit clientDetached();
+		}
+
+		quint32 head = shmLoad(&seg->to_editor.head);
+		if (attached && head != shmLoad(&seg->to_editor.tail) &&
+		    readPending.testAndSetOrdered(0, 1))
+			emit readyRead();
+
+		// sleep until the demo writes, but look at the state now and then
+		ringWait(&seg->to_editor, head, 10);
+	}
+}
+
+ShmServer::ShmServer() :
+    segment(NULL),
+    watcher(NULL),
+    connected(false)
+{
+}
+
+ShmServer::~ShmServer()
+{
+	if (watcher) {
+		watcher->stop();
+		watcher->wait();
+		delete watcher;
+	}
+
+	if (segment) {
+		shmStore(&segment->state, SYNC_SHM_CLOSED);
+		munmap(segment, sizeof(*segment));
+		shm_unlink(name.constData());
+	}
+}
+
+bool ShmServer::listen(const QString &name)
+{
+	Q_ASSERT(!segment);
+	this->name = QFile::encodeName(name);
+
+	// a previous editor might have crashed without cleaning up
+	shm_unlink(this->name.constData());
+
+	int fd = shm_open(this->name.constData(), O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd < 0) {
+		error = QString::fromLocal8Bit(strerror(errno));
+		return false;
+	}
+
+	if (ftruncate(fd, sizeof(SyncShmSegment)) < 0) {
+		error = QString::fromLocal8Bit(strerror(errno));
+		::close(fd);
+		shm_unlink(this->name.constData());
+		return false;
+	}
+
+	void *ptr = mmap(NULL, sizeof(SyncShmSegment), PROT_READ | PROT_WRITE,
+	                 MAP_SHARED, fd, 0);
+	::close(fd);
+	if (ptr == MAP_FAILED) {
+		error = QString::fromLocal8Bit(strerror(errno));
+		shm_unlink(this->name.constData());
+		return false;
+	}
+
+	segment = static_cast<SyncShmSegment *>(ptr);
+	segment->magic = SYNC_SHM_MAGIC;
+	segment->version = SYNC_SHM_VERSION;
+	segment->session = 1;
+	shmStore(&segment->state, SYNC_SHM_LISTENING);
+
+	watcher = new ShmWatcher(this);
+	connect(watcher, SIGNAL(clientAttached()), this, SLOT(onClientAttached()));
+	connect(watcher, SIGNAL(clientDetached()), this, SLOT(onClientDetached()));
+	connect(watcher, SIGNAL(readyRead()), this, SLOT(onReadyRead()));
+	watcher->start();
+	return true;
+}
+
+bool ShmServer::isConnected() const
+{
+	return connected && shmLoad(&segment->state) == SYNC_SHM_CONNECTED;
+}
+
+qint64 ShmServer::bytesAvailable() const
+{
+	if (!connected)
+		return 0;
+	const SyncShmRing *r = &segment->to_editor;
+	return quint32(shmLoad(&r->head) - r->tail);
+}
+
+qint64 ShmServer::read(char *data, qint64 maxSize)
+{
+	SyncShmRing *r = &segment->to_editor;
+	qint64 ret = 0;
+	while (ret < maxSize) {
+		quint32 tail = r->tail;
+		quint32 pos = tail & (SYNC_SHM_RING_SIZE - 1);
+		qint64 n = quint32(shmLoad(&r->head) - tail);
+		if (!n)
+			break;
+
+		n = qMin(n, maxSize - ret);
+		n = qMin(n, qint64(SYNC_SHM_RING_SIZE - pos));
+		memcpy(data + ret, r->data + pos, n);
+		shmStore(&r->tail, tail + quint32(n));
+		ret += n;
+	}
+	return ret;
+}
+
+qint64 ShmServer::write(const char *data, qint64 size)
+{
+	if (!isConnected())
+		return -1;
+
+	// never wait for the demo; whatever doesn't fit is left to the caller
+	SyncShmRing *r = &segment->to_demo;
+	qint64 ret = 0;
+	while (ret < size) {
+		quint32 head = r->head;
+		quint32 pos = head & (SYNC_SHM_RING_SIZE - 1);
+		qint64 n = SYNC_SHM_RING_SIZE - quint32(head - shmLoad(&r->tail));
+		if (!n)
+			break;
+
+		n = qMin(n, size - ret);
+		n = qMin(n, qint64(SYNC_SHM_RING_SIZE - pos));
+		memcpy(r->data + pos, data + ret, n);
+		shmStore(&r->head, head + quint32(n));
+		ret += n;
+	}
+
+	if (ret)
+		ringWake(r);
+	return ret;
+}
+
+void ShmServer::closeConnection()
+{
+	if (!segment)
+		return;
+
+	// invalidate the old session before the rings are recycled
+	shmStore(&segment->state, SYNC_SHM_CLOSED);
+	shmStore(&segment->session, shmLoad(&segment->session) + 1);
+	ringWake(&segment->to_demo);
+
+	shmStore(&segment->to_demo.head, 0);
+	shmStore(&segment->to_demo.tail, 0);
+	shmStore(&segment->to_editor.head, 0);
+	shmStore(&segment->to_editor.tail, 0);
+	shmStore(&segment->client_pid, 0);
+	connected = false;
+
+	shmStore(&segment->state, SYNC_SHM_LISTENING);
+}
+
+void ShmServer::onClientAttached()
+{
+	connected = true;
+	emit newConnection();
+}
+
+void ShmServer::onClientDetached()
+{
+	if (connected) {
+		connected = false;
+		emit disconnected();
+	} else if (shmLoad(&segment->state) == SYNC_SHM_CONNECTED &&
+	           !processAlive(shmLoad(&segment->client_pid)))
+		closeConnection();
+}
+
+void ShmServer::onReadyRead()
+{
+	watcher->readPending.storeRelease(0);
+	if (connected)
+		emit readyRead();
+}
@@ -0,0 +1,80 @@
+#ifndef SHMSERVER_H
+#define SHMSERVER_H
+
+#include <QObject>
+#include <QString>
+#include <QThread>
+#include <QAtomicInt>
+#include <QByteArray>
+
+// the segment layout is shared with the demo side
+#include "../lib/shm.h"
+
+typedef struct sync_shm_ring SyncShmRing;
+typedef struct sync_shm_segment SyncShmSegment;
+
+class ShmServer;
+
+class ShmWatcher : public QThread {
+	Q_OBJECT
+public:
+	explicit ShmWatcher(ShmServer *server) : server(server) {}
+
+	void stop() { stopping.storeRelease(1); }
+
+	QAtomicInt readPending;
+
+signals:
+	void clientAttached();
+	void clientDetached();
+	void readyRead();
+
+private:
+	void run();
+
+	ShmServer *server;
+	QAtomicInt stopping;
+};
+
+/*
+ * Accepts a single demo on the same host through a shared-memory segment,
+ * see lib/shm.h. The segment is polled by a watcher thread that sleeps on
+ * the demo's ring, so the GUI thread only gets woken up when there is work.
+ */
+class ShmServer : public QObject {
+	Q_OBJECT
+	friend class ShmWatcher;
+public:
+	ShmServer();
+	~ShmServer();
+
+	bool listen(const QString &name);
+	QString errorString() const { return error; }
+
+	bool isConnected() const;
+	qint64 bytesAvailable() const;
+	qint64 read(char *data, qint64 maxSize);
+	qint64 write(const char *data, qint64 size); // only what fits the ring
+
+	// hang up on the current demo, and wait for the next one
+	void closeConnection();
+
+signals:
+	void newConnection();
+	void readyRead();
+	void disconnected();
+
+private slots:
+	void onClientAttached();
+	void onClientDetached();
+	void onReadyRead();
+
+private:
+	QByteArray name;
+	QString error;
+	SyncShmSegment *segment;
+	ShmWatcher *watcher;
+	bool connected;
+};
+
+#endif // !defined(SHMSERVER_H)
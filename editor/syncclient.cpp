@@ -2,14 +2,87 @@
 #include "syncdocument.h"
 
 #include <QDataStream>
+#include <QThread>
+#include <QTimer>
 #include <QtEndian>
 
-void SyncClient::sendSetKeyCommand(const QString &trackName, const SyncTrack::TrackKey &key)
+// keep a bogus length from making us wait for gigabytes
+static const quint32 maxTrackNameLength = 64 * 1024;
+
+// how long a demo gets to say hello
+static const int handshakeTimeout = 5000;
+
+void SyncCommandParser::append(const char *data, int size)
 {
-	int trackIndex = trackNames.indexOf(trackName);
-	if (trackIndex < 0)
-		return;
+	if (pos == buffer.size()) {
+		buffer.clear();
+		pos = 0;
+	} else if (pos > 64 * 1024) {
+		buffer.remove(0, pos);
+		pos = 0;
+	}
+	buffer.append(data, size);
+}
+
+SyncCommandParser::Result SyncCommandParser::next(SyncCommand *cmd)
+{
+	int avail = buffer.size() - pos;
+	if (avail < 1)
+		return MORE_DATA;
+
+	const uchar *data = (const uchar *)buffer.constData() + pos;
+	cmd->cmd = data[0];
+	cmd->size = 1;
+
+	switch (data[0]) {
+	case GET_TRACK:
+	{
+		if (avail < 5)
+			return MORE_DATA;
+
+		quint32 strLen = qFromBigEndian<quint32>(data + 1);
+		if (!strLen || strLen > maxTrackNameLength)
+			return PROTOCOL_ERROR;
+
+		if (quint32(avail - 5) < strLen)
+			return MORE_DATA;
 
+		QByteArray name((const char *)data + 5, strLen);
+		if (name.contains('\0'))
+			return PROTOCOL_ERROR;
+
+		cmd->trackName = QString::fromUtf8(name);
+		cmd->size = 5 + strLen;
+	}
+	break;
+
+	case SET_ROW:
+		if (avail < 5)
+			return MORE_DATA;
+
+		cmd->row = qFromBigEndian<quint32>(data + 1);
+		cmd->size = 5;
+		break;
+
+	// PING, PONG and anything we don't know carry no payload
+	}
+
+	pos += cmd->size;
+	return COMMAND_READY;
+}
+
+SyncClient::SyncClient() :
+    paused(false),
+    greeted(false),
+    peerPings(false),
+    pingPending(false),
+    flushScheduled(false),
+    backlog(0)
+{
+}
+
+QByteArray SyncClient::encodeSetKey(const SyncTrack::TrackKey &key)
+{
 	union {
 		float f;
 		quint32 i;
@@ -18,28 +91,45 @@ void SyncClient::sendSetKeyCommand(const QString &trackName, const SyncTrack::Tr
 
 	Q_ASSERT(key.type < SyncTrack::TrackKey::KEY_TYPE_COUNT);
 
-	QByteArray data;
-	QDataStream ds(&data, QIODevice::WriteOnly);
-	ds << (unsigned char)SET_KEY;
-	ds << (quint32)trackIndex;
-	ds << (quint32)key.row;
-	ds << v.i;
-	ds << (unsigned char)key.type;
-	sendData(data);
+	QByteArray data(9, Qt::Uninitialized);
+	uchar *ptr = (uchar *)data.data();
+	qToBigEndian<quint32>(key.row, ptr);
+	qToBigEndian<quint32>(v.i, ptr + 4);
+	ptr[8] = uchar(key.type);
+	return data;
 }
 
-void SyncClient::sendDeleteKeyCommand(const QString &trackName, int row)
+QByteArray SyncClient::encodeDeleteKey(int row)
 {
-	int trackIndex = trackNames.indexOf(trackName);
-	if (trackIndex < 0)
+	QByteArray data(4, Qt::Uninitialized);
+	qToBigEndian<quint32>(row, (uchar *)data.data());
+	return data;
+}
+
+void SyncClient::sendTrackCommand(unsigned char cmd, const QString &trackName, const QByteArray &payload)
+{
+	int trackIndex = trackIndices.value(trackName, -1);
+	if (trackIndex < 0 || !greeted)
 		return;
 
-	QByteArray data;
-	QDataStream ds(&data, QIODevice::WriteOnly);
-	ds << (unsigned char)DELETE_KEY;
-	ds << (quint32)trackIndex;
-	ds << (quint32)row;
-	sendData(data);
+	uchar header[5];
+	header[0] = cmd;
+	qToBigEndian<quint32>(trackIndex, header + 1);
+
+	stats.commandsOut[cmd]++;
+	stats.bytesOut += sizeof(header) + payload.size();
+	outbox.append((const char *)header, sizeof(header));
+	queueData(payload.constData(), payload.size());
+}
+
+void SyncClient::sendSetKeyCommand(const QString &trackName, const SyncTrack::TrackKey &key)
+{
+	sendTrackCommand(SET_KEY, trackName, encodeSetKey(key));
+}
+
+void SyncClient::sendDeleteKeyCommand(const QString &trackName, int row)
+{
+	sendTrackCommand(DELETE_KEY, trackName, encodeDeleteKey(row));
 }
 
 void SyncClient::sendSetRowCommand(int row)
@@ -48,7 +138,7 @@ void SyncClient::sendSetRowCommand(int row)
 	QDataStream ds(&data, QIODevice::WriteOnly);
 	ds << (unsigned char)SET_ROW;
 	ds << (quint32)row;
-	sendData(data);
+	sendCommand(data);
 }
 
 void SyncClient::sendPauseCommand(bool pause)
@@ -57,14 +147,147 @@ void SyncClient::sendPauseCommand(bool pause)
 	QDataStream ds(&data, QIODevice::WriteOnly);
 	ds << (unsigned char)PAUSE;
 	ds << (unsigned char)pause;
-	sendData(data);
+	sendCommand(data);
 }
 
 void SyncClient::sendSaveCommand()
 {
 	QByteArray data;
 	data.append(SAVE_TRACKS);
-	sendData(data);
+	sendCommand(data);
+}
+
+void SyncClient::sendPing()
+{
+	// only demos that have pinged us know how to answer
+	if (!peerPings || pingPending)
+		return;
+
+	QByteArray data;
+	data.append(PING);
+	sendCommand(data);
+
+	pingPending = true;
+	pingTimer.start();
+}
+
+void SyncClient::sendCommand(const QByteArray &data)
+{
+	if (!greeted)
+		return; // the demo gets the current state once it has said hello
+
+	Q_ASSERT(data.size() > 0 && (unsigned char)data[0] <= PONG);
+	stats.commandsOut[(unsigned char)data[0]]++;
+	stats.bytesOut += data.size();
+	queueData(data.constData(), data.size());
+}
+
+void SyncClient::queueData(const char *data, int size)
+{
+	outbox.append(data, size);
+
+	// a zero-timer fires once the current event has been handled, so a
+	// whole paste or undo macro goes out as a single write
+	scheduleFlush(0);
+}
+
+void SyncClient::scheduleFlush(int msecs)
+{
+	if (!flushScheduled) {
+		flushScheduled = true;
+		QTimer::singleShot(msecs, this, SLOT(flushOutbox()));
+	}
+}
+
+void SyncClient::flushOutbox()
+{
+	flushScheduled = false;
+	if (outbox.isEmpty())
+		return;
+
+	qint64 ret = sendData(outbox);
+	if (ret < 0) {
+		dropConnection("send failed");
+		return;
+	}
+	outbox.remove(0, ret);
+
+	// however much one event queued, only what was already waiting at
+	// the last flush and still is counts against the cap
+	if (backlog - ret > maxOutboxSize) {
+		dropConnection("client is not keeping up");
+		return;
+	}
+	backlog = outbox.size();
+
+	// the transport is backed up, try again in a bit
+	if (!outbox.isEmpty())
+		scheduleFlush(5);
+}
+
+void SyncClient::dropConnection(const QString &reason)
+{
+	outbox.clear();
+	backlog = 0;
+	close();
+
+	// we might be in the middle of a broadcast, so let the owner know later
+	QMetaObject::invokeMethod(this, "disconnected", Qt::QueuedConnection,
+	                          Q_ARG(QString, reason));
+}
+
+void SyncClient::processCommand(const SyncCommand &cmd)
+{
+	stats.bytesIn += cmd.size;
+	if (cmd.cmd <= PONG)
+		stats.commandsIn[cmd.cmd]++;
+
+	switch (cmd.cmd) {
+	case GET_TRACK:
+		requestTrack(cmd.trackName);
+		break;
+
+	case SET_ROW:
+		emit rowChanged(cmd.row);
+		break;
+
+	case PING:
+		processPing();
+		break;
+
+	case PONG:
+		processPong();
+		break;
+	}
+}
+
+bool SyncClient::processData(const char *data, int size)
+{
+	parser.append(data, size);
+
+	SyncCommand cmd;
+	SyncCommandParser::Result res;
+	while ((res = parser.next(&cmd)) == SyncCommandParser::COMMAND_READY)
+		processCommand(cmd);
+
+	return res != SyncCommandParser::PROTOCOL_ERROR;
+}
+
+void SyncClient::processPing()
+{
+	peerPings = true;
+
+	QByteArray data;
+	data.append(PONG);
+	sendCommand(data);
+}
+
+void SyncClient::processPong()
+{
+	if (pingPending) {
+		stats.rtt = pingTimer.nsecsElapsed() / 1e9;
+		pingPending = false;
+	}
 }
 
 void SyncClient::setPaused(bool pause)
@@ -77,85 +300,275 @@ void SyncClient::setPaused(bool pause)
 
 void SyncClient::requestTrack(const QString &trackName)
 {
+	// a repeated request keeps the index the demo saw first
+	if (!trackIndices.contains(trackName))
+		trackIndices.insert(trackName, trackNames.size());
 	trackNames.append(trackName);
 	emit trackRequested(trackName);
 }
 
-bool AbstractSocketClient::recv(char *buffer, qint64 length)
+void SyncClientGroup::connectTrack(SyncTrack *track)
 {
-	// wait for enough data to arrive
-	while (socket->bytesAvailable() < length) {
-		if (!socket->waitForReadyRead(-1))
-			return false;
-	}
+	connect(track, SIGNAL(keysChanged(const SyncTrack::KeyChanges &)),
+	        this, SLOT(onKeysChanged(const SyncTrack::KeyChanges &)), Qt::UniqueConnection);
+}
 
-	qint64 ret = socket->read(buffer, length);
-	Q_ASSERT(ret == length);
-	Q_UNUSED(ret);
-	return true;
+void SyncClientGroup::disconnectTrack(SyncTrack *track)
+{
+	disconnect(track, SIGNAL(keysChanged(const SyncTrack::KeyChanges &)),
+	           this, SLOT(onKeysChanged(const SyncTrack::KeyChanges &)));
 }
 
-void AbstractSocketClient::processCommand()
+void SyncClientGroup::broadcast(unsigned char cmd, const QString &trackName, const QByteArray &payload)
 {
-	unsigned char cmd = 0;
-	if (recv((char*)&cmd, 1)) {
-		switch (cmd) {
-		case GET_TRACK:
-			processGetTrack();
-			break;
+	// clients may drop out while we send, so walk a copy
+	QList<SyncClient *> targets = clients;
+	for (int i = 0; i < targets.size(); ++i)
+		targets[i]->sendTrackCommand(cmd, trackName, payload);
+}
 
-		case SET_ROW:
-			processSetRow();
-			break;
-		}
+void SyncClientGroup::onKeysChanged(const SyncTrack::KeyChanges &changes)
+{
+	const SyncTrack *track = qobject_cast<SyncTrack *>(sender());
+	if (clients.isEmpty())
+		return;
+
+	// only the final state of each row matters to the demo
+	for (int i = 0; i < changes.rows.size(); ++i) {
+		int row = changes.rows[i];
+		if (track->isKeyFrame(row))
+			broadcast(SET_KEY, track->getName(),
+			          SyncClient::encodeSetKey(track->getKeyFrame(row)));
+		else
+			broadcast(DELETE_KEY, track->getName(),
+			          SyncClient::encodeDeleteKey(row));
 	}
 }
 
-void AbstractSocketClient::processGetTrack()
+SocketWorker::SocketWorker(QAbstractSocket *socket) :
+    socket(socket),
+    greeted(false),
+    closing(false)
 {
-	// read data
-	quint32 strLen;
-	if (!recv((char *)&strLen, sizeof(strLen))) {
-		close();
+	// the socket follows us to the worker thread
+	socket->setParent(this);
+}
+
+void SocketWorker::start()
+{
+	connect(socket, SIGNAL(readyRead()), this, SLOT(onReadyRead()));
+	connect(socket, SIGNAL(bytesWritten(qint64)), this, SLOT(onBytesWritten(qint64)));
+	connect(socket, SIGNAL(disconnected()), this, SLOT(onDisconnected()));
+
+	// commands are batched already, don't let the kernel hold them back
+	socket->setSocketOption(QAbstractSocket::LowDelayOption, 1);
+
+	QTimer::singleShot(handshakeTimeout, this, SLOT(onHandshakeTimeout()));
+
+	// the greeting might have arrived before we got hooked up
+	if (socket->bytesAvailable() > 0)
+		onReadyRead();
+}
+
+void SocketWorker::write(const QByteArray &data)
+{
+	if (closing)
 		return;
-	}
 
-	strLen = qFromBigEndian(strLen);
+	socket->write(data);
+}
 
-	if (!strLen) {
-		close();
+void SocketWorker::close()
+{
+	closing = true;
+	socket->close();
+}
+
+void SocketWorker::fail(const QString &reason)
+{
+	if (closing)
 		return;
-	}
 
-	QByteArray trackNameBuffer;
-	trackNameBuffer.resize(strLen);
-	if (!recv(trackNameBuffer.data(), strLen) ||
-	    trackNameBuffer.contains('\0')) {
-		close();
+	close();
+	emit disconnected(reason);
+}
+
+void SocketWorker::onReadyRead()
+{
+	if (closing)
 		return;
+
+	if (!greeted) {
+		QByteArray greeting = QString(CLIENT_GREET).toUtf8();
+		QByteArray response = QString(SERVER_GREET).toUtf8();
+		if (socket->bytesAvailable() < greeting.length())
+			return;
+
+		QByteArray line = socket->read(greeting.length());
+		if (line != greeting ||
+		    socket->write(response) != response.length()) {
+			fail("invalid greeting");
+			return;
+		}
+
+		greeted = true;
+		emit connected();
 	}
 
-	requestTrack(QString::fromUtf8(trackNameBuffer));
+	QByteArray data = socket->readAll();
+	parser.append(data.constData(), data.size());
+
+	SyncCommand cmd;
+	SyncCommandParser::Result res;
+	while ((res = parser.next(&cmd)) == SyncCommandParser::COMMAND_READY)
+		emit commandReceived(cmd);
+
+	if (res == SyncCommandParser::PROTOCOL_ERROR)
+		fail("protocol error");
 }
 
-void AbstractSocketClient::processSetRow()
+void SocketWorker::onBytesWritten(qint64 bytes)
 {
-	quint32 newRow;
-	if (recv((char *)&newRow, sizeof(newRow)))
-		emit rowChanged(qFromBigEndian(newRow));
+	// our own greeting is not accounted for
+	if (pending.load() > 0)
+		pending.fetchAndAddOrdered(-int(qMin(bytes, qint64(pending.load()))));
+
+	if (blocked.testAndSetOrdered(1, 0))
+		emit drained();
 }
 
-void AbstractSocketClient::onReadyRead()
+void SocketWorker::onDisconnected()
 {
-	while (socket->bytesAvailable() > 0)
-		processCommand();
+	fail(socket->errorString());
 }
 
-void AbstractSocketClient::onDisconnected()
+void SocketWorker::onHandshakeTimeout()
 {
-	emit disconnected(socket->errorString());
+	if (!greeted)
+		fail("handshake timed out");
+}
+
+AbstractSocketClient::AbstractSocketClient(QAbstractSocket *socket) :
+    peer(socket->peerAddress().toString())
+{
+	qRegisterMetaType<SyncCommand>("SyncCommand");
+
+	socket->setParent(NULL);
+	thread = new QThread(this);
+	worker = new SocketWorker(socket);
+	worker->moveToThread(thread);
+
+	connect(thread, SIGNAL(finished()), worker, SLOT(deleteLater()));
+	connect(worker, SIGNAL(connected()), this, SLOT(onConnected()));
+	connect(worker, SIGNAL(disconnected(const QString &)), this, SIGNAL(disconnected(const QString &)));
+	connect(worker, SIGNAL(commandReceived(const SyncCommand &)), this, SLOT(processCommand(const SyncCommand &)));
+	connect(worker, SIGNAL(drained()), this, SLOT(flushOutbox()));
+
+	thread->start();
+	QMetaObject::invokeMethod(worker, "start", Qt::QueuedConnection);
 }
 
+AbstractSocketClient::~AbstractSocketClient()
+{
+	close();
+	thread->quit();
+	thread->wait();
+}
+
+void AbstractSocketClient::close()
+{
+	// nothing more from this one, even if it is already queued
+	disconnect(worker, 0, this, 0);
+	QMetaObject::invokeMethod(worker, "close", Qt::QueuedConnection);
+}
+
+qint64 AbstractSocketClient::sendData(const QByteArray &data)
+{
+	// keep the backlog in our own outbox, where it is capped
+	if (worker->pending.load() > (1 << 20)) {
+		worker->blocked.storeRelease(1);
+		return 0;
+	}
+
+	worker->pending.fetchAndAddOrdered(data.size());
+	QMetaObject::invokeMethod(worker, "write", Qt::QueuedConnection,
+	                          Q_ARG(QByteArray, data));
+	return data.size();
+}
+
+void AbstractSocketClient::onConnected()
+{
+	greeted = true;
+	emit connected();
+}
+
+#ifdef USE_SHM
+#include "shmserver.h"
+
+ShmClient::ShmClient(ShmServer *server) :
+    server(server)
+{
+	connect(server, SIGNAL(readyRead()), this, SLOT(onReadyRead()));
+	connect(server, SIGNAL(disconnected()), this, SLOT(onDisconnected()));
+
+	// the greeting might have arrived before we got hooked up
+	if (server->bytesAvailable() > 0)
+		onReadyRead();
+}
+
+ShmClient::~ShmClient()
+{
+	close();
+}
+
+void ShmClient::close()
+{
+	disconnect(server, SIGNAL(readyRead()), this, SLOT(onReadyRead()));
+	disconnect(server, SIGNAL(disconnected()), this, SLOT(onDisconnected()));
+	server->closeConnection();
+}
+
+qint64 ShmClient::sendData(const QByteArray &data)
+{
+	return server->write(data.constData(), data.length());
+}
+
+void ShmClient::onReadyRead()
+{
+	if (!greeted) {
+		QByteArray greeting = QString(CLIENT_GREET).toUtf8();
+		QByteArray response = QString(SERVER_GREET).toUtf8();
+		if (server->bytesAvailable() < greeting.length())
+			return;
+
+		QByteArray line(greeting.length(), '\0');
+		server->read(line.data(), line.length());
+		if (line != greeting ||
+		    sendData(response) != response.length()) {
+			close();
+			emit disconnected("invalid greeting");
+			return;
+		}
+
+		greeted = true;
+		emit connected();
+	}
+
+	QByteArray data(int(server->bytesAvailable()), '\0');
+	data.resize(int(server->read(data.data(), data.size())));
+	if (!processData(data.constData(), data.size())) {
+		close();
+		emit disconnected("protocol error");
+	}
+}
+
+void ShmClient::onDisconnected()
+{
+	emit disconnected("demo detached");
+}
+
+#endif // defined(USE_SHM)
+
 #ifdef QT_WEBSOCKETS_LIB
 #include <QWebSocket>
 
@@ -164,6 +577,7 @@ WebSocketClient::WebSocketClient(QWebSocket *socket) :
 {
 	connect(socket, SIGNAL(textMessageReceived(const QString &)), this, SLOT(processTextMessage(const QString &)));
 	connect(socket, SIGNAL(disconnected()), this, SLOT(onDisconnected()));
+	QTimer::singleShot(handshakeTimeout, this, SLOT(onHandshakeTimeout()));
 	if (!socket->isValid())
 		emit disconnected(socket->errorString());
 }
@@ -175,9 +589,19 @@ void WebSocketClient::close()
 
 qint64 WebSocketClient::sendData(const QByteArray &data)
 {
+	// one message per batch; messages can't be split, so QWebSocket
+	// does the queueing here, and the backlog waits in our own outbox
+	if (socket->bytesToWrite() > maxOutboxSize)
+		return 0;
+
 	return socket->sendBinaryMessage(data);
 }
 
+QString WebSocketClient::peerName() const
+{
+	return socket->peerAddress().toString();
+}
+
 void WebSocketClient::processTextMessage(const QString &message)
 {
 	QObject::disconnect(socket, SIGNAL(textMessageReceived(const QString &)), this, SLOT(processTextMessage(const QString &)));
@@ -188,35 +612,21 @@ void WebSocketClient::processTextMessage(const QString &message)
 		socket->close();
 	} else {
 		connect(socket, SIGNAL(binaryMessageReceived(const QByteArray &)), this, SLOT(onMessageReceived(const QByteArray &)));
+		greeted = true;
 		emit connected();
 	}
 }
 
 void WebSocketClient::onMessageReceived(const QByteArray &data)
 {
-	QDataStream ds(data);
-	quint8 cmd;
-	ds >> cmd;
-
-	switch (cmd) {
-	case GET_TRACK:
-	{
-		quint32 length;
-		ds >> length;
-		Q_ASSERT(1 + sizeof(length) + length == size_t(data.length()));
-		QByteArray nameData(data.constData() + 1 + sizeof(length), length);
-		requestTrack(QString::fromUtf8(nameData));
-	}
-	break;
+	if (!processData(data.constData(), data.size()))
+		socket->close();
+}
 
-	case SET_ROW:
-	{
-		quint32 row;
-		ds >> row;
-		emit rowChanged(row);
-	}
-	break;
-	}
+void WebSocketClient::onHandshakeTimeout()
+{
+	if (!greeted)
+		socket->close();
 }
 
 void WebSocketClient::onDisconnected()
@@ -2,9 +2,14 @@
 #define CLIENTSOCKET_H
 
 #include <QTcpSocket>
+#include <QAtomicInt>
 #include <QByteArray>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QMetaType>
 #include <QObject>
 #include <QStringList>
+#include <QTimer>
 
 #include "synctrack.h"
 
@@ -17,22 +22,77 @@ enum {
 	GET_TRACK = 2,
 	SET_ROW = 3,
 	PAUSE = 4,
-	SAVE_TRACKS = 5
+	SAVE_TRACKS = 5,
+	PING = 6,
+	PONG = 7
+};
+
+struct SyncCommand {
+	SyncCommand() : cmd(0), row(0), size(0) {}
+
+	unsigned char cmd;
+	int row;           // SET_ROW
+	QString trackName; // GET_TRACK
+	int size;          // bytes on the wire
+};
+Q_DECLARE_METATYPE(SyncCommand)
+
+/*
+ * Pulls commands out of a byte-stream as the bytes come in, so nothing
+ * ever has to wait for the rest of a command to arrive.
+ */
+class SyncCommandParser {
+public:
+	SyncCommandParser() : pos(0) {}
+
+	enum Result {
+		MORE_DATA,
+		COMMAND_READY,
+		PROTOCOL_ERROR
+	};
+
+	void append(const char *data, int size);
+	Result next(SyncCommand *cmd);
+
+private:
+	QByteArray buffer;
+	int pos;
 };
 
 class SyncClient : public QObject {
 	Q_OBJECT
 
 public:
-	SyncClient() : paused(false) { }
+	SyncClient();
 
 	virtual void close() = 0;
+	virtual QString peerName() const = 0;
+
+	// non-blocking, returns the number of bytes the transport accepted
 	virtual qint64 sendData(const QByteArray &data) = 0;
 
 	void sendSetKeyCommand(const QString &trackName, const SyncTrack::TrackKey &key);
 	void sendDeleteKeyCommand(const QString &trackName, int row);
+	void sendTrackCommand(unsigned char cmd, const QString &trackName, const QByteArray &payload);
 	void sendSetRowCommand(int row);
 	void sendSaveCommand();
+	void sendPing();
+
+	static QByteArray encodeSetKey(const SyncTrack::TrackKey &key);
+	static QByteArray encodeDeleteKey(int row);
+
+	struct Stats {
+		Stats() : bytesIn(0), bytesOut(0), rtt(-1.0)
+		{
+			for (int i = 0; i <= PONG; ++i)
+				commandsIn[i] = commandsOut[i] = 0;
+		}
+
+		quint64 bytesIn, bytesOut;
+		quint64 commandsIn[PONG + 1], commandsOut[PONG + 1];
+		double rtt; // seconds, negative until the first PONG
+	};
+	const Stats &getStats() const { return stats; }
 
 	const QStringList getTrackNames() { return trackNames; }
 	bool isPaused() { return paused; }
@@ -44,74 +104,202 @@ signals:
 	void trackRequested(const QString &trackName);
 	void rowChanged(int row);
 
-public slots:
-	void onKeyFrameAdded(int row)
-	{
-		const SyncTrack *track = qobject_cast<SyncTrack *>(sender());
-		sendSetKeyCommand(track->getName(), track->getKeyFrame(row));
-	}
-
-	void onKeyFrameChanged(int row, const SyncTrack::TrackKey &)
-	{
-		const SyncTrack *track = qobject_cast<SyncTrack *>(sender());
-		sendSetKeyCommand(track->getName(), track->getKeyFrame(row));
-	}
-
-	void onKeyFrameRemoved(int row, const SyncTrack::TrackKey &)
-	{
-		const SyncTrack *track = qobject_cast<SyncTrack *>(sender());
-		sendDeleteKeyCommand(track->getName(), row);
-	}
+protected slots:
+	void flushOutbox();
+	void processCommand(const SyncCommand &cmd);
 
 protected:
 	void requestTrack(const QString &trackName);
 	void sendPauseCommand(bool pause);
+	void sendCommand(const QByteArray &data);
+	void processPing();
+	void processPong();
+	void queueData(const char *data, int size);
+	void scheduleFlush(int msecs);
+	void dropConnection(const QString &reason);
+	bool processData(const char *data, int size);
 
 	QList<QString> trackNames;
+	QHash<QString, int> trackIndices;
 	bool paused;
+	bool greeted; // nothing may be sent before the server greeting
+	Stats stats;
+
+	static const int maxOutboxSize = 64 << 20;
+
+private:
+	bool peerPings, pingPending;
+	QElapsedTimer pingTimer;
+
+	// commands waiting for the next flush, or for the transport to take
+	// them; a client that leaves more than maxOutboxSize of it unsent
+	// from one flush to the next is dropped rather than holding the
+	// others up
+	QByteArray outbox;
+	bool flushScheduled;
+	int backlog; // what the last flush left in the outbox
+
+	SyncCommandParser parser;
 };
 
-class AbstractSocketClient : public SyncClient {
+/*
+ * Fans edits out to every connected client. Key payloads are encoded once,
+ * only the track index, which each client assigns itself, differs.
+ */
+class SyncClientGroup : public QObject {
 	Q_OBJECT
 public:
-	explicit AbstractSocketClient(QAbstractSocket *socket) : socket(socket)
-	{
-		connect(socket, SIGNAL(readyRead()), this, SLOT(onReadyRead()));
-		connect(socket, SIGNAL(disconnected()), this, SLOT(onDisconnected()));
-	}
+	explicit SyncClientGroup(QObject *parent = NULL) : QObject(parent) {}
+
+	void addClient(SyncClient *client) { clients.append(client); }
+	void removeClient(SyncClient *client) { clients.removeAll(client); }
+	const QList<SyncClient *> &getClients() const { return clients; }
+	bool isEmpty() const { return clients.isEmpty(); }
+
+	void connectTrack(SyncTrack *track);
+	void disconnectTrack(SyncTrack *track);
+
+public slots:
+	void onKeysChanged(const SyncTrack::KeyChanges &changes);
+
+private:
+	void broadcast(unsigned char cmd, const QString &trackName, const QByteArray &payload);
 
-	virtual void close()
+	QList<SyncClient *> clients;
+};
+
+/*
+ * Passes rows on at most once per interval, latest wins: a row after a
+ * quiet spell goes out at once, and any that follow within the interval
+ * collapse into one at its end. An interval of 0 passes everything.
+ */
+class RowCoalescer : public QObject {
+	Q_OBJECT
+public:
+	explicit RowCoalescer(QObject *parent = NULL) :
+	    QObject(parent), row(0), pending(false)
 	{
-		disconnect(socket, SIGNAL(readyRead()), this, SLOT(onReadyRead()));
-		disconnect(socket, SIGNAL(disconnected()), this, SLOT(onDisconnected()));
-		socket->close();
+		timer.setSingleShot(true);
+		connect(&timer, SIGNAL(timeout()), this, SLOT(onTimeout()));
 	}
 
-	qint64 sendData(const QByteArray &data)
+	void setInterval(int msec) { timer.setInterval(msec); }
+
+	void setRow(int row)
 	{
-		qint64 ret = socket->write(data);
-		socket->flush();
-		return ret;
+		this->row = row;
+		if (timer.isActive()) {
+			pending = true;
+			return;
+		}
+
+		emit rowReady(row);
+		if (timer.interval() > 0)
+			timer.start();
 	}
 
-	void notifyConnected()
+signals:
+	void rowReady(int row);
+
+private slots:
+	void onTimeout()
 	{
-		emit connected();
+		if (pending) {
+			pending = false;
+			emit rowReady(row);
+			timer.start();
+		}
 	}
 
 private:
+	QTimer timer;
+	int row;
+	bool pending;
+};
+
+class QThread;
+
+/*
+ * Owns a TCP socket on its own thread: the greeting, reading and parsing
+ * all happen there, and only complete commands reach the GUI thread.
+ */
+class SocketWorker : public QObject {
+	Q_OBJECT
+public:
+	explicit SocketWorker(QAbstractSocket *socket);
+
+	// bytes handed to the worker that the socket has not written yet
+	QAtomicInt pending;
+	QAtomicInt blocked;
+
+public slots:
+	void start();
+	void write(const QByteArray &data);
+	void close();
+
+signals:
+	void connected();
+	void disconnected(const QString &reason);
+	void commandReceived(const SyncCommand &cmd);
+	void drained();
+
+private slots:
+	void onReadyRead();
+	void onBytesWritten(qint64 bytes);
+	void onDisconnected();
+	void onHandshakeTimeout();
+
+private:
+	void fail(const QString &reason);
+
 	QAbstractSocket *socket;
-	bool recv(char *buffer, qint64 length);
+	SyncCommandParser parser;
+	bool greeted, closing;
+};
 
-	void processCommand();
-	void processGetTrack();
-	void processSetRow();
+class AbstractSocketClient : public SyncClient {
+	Q_OBJECT
+public:
+	explicit AbstractSocketClient(QAbstractSocket *socket);
+	~AbstractSocketClient();
+
+	void close();
+	qint64 sendData(const QByteArray &data);
+	QString peerName() const { return peer; }
+
+private slots:
+	void onConnected();
+
+private:
+	QThread *thread;
+	SocketWorker *worker;
+	QString peer;
+};
+
+#ifdef USE_SHM
+
+class ShmServer;
+
+class ShmClient : public SyncClient {
+	Q_OBJECT
+public:
+	explicit ShmClient(ShmServer *server);
+	~ShmClient();
+
+	void close();
+	qint64 sendData(const QByteArray &data);
+	QString peerName() const { return "local demo"; }
+
+private:
+	ShmServer *server;
 
 private slots:
 	void onReadyRead();
 	void onDisconnected();
 };
 
+#endif
+
 #ifdef QT_WEBSOCKETS_LIB
 
 class QWebSocket;
@@ -122,10 +310,12 @@ public:
 	explicit WebSocketClient(QWebSocket *socket);
 	void close();
 	qint64 sendData(const QByteArray &data);
+	QString peerName() const;
 
 private slots:
 	void processTextMessage(const QString &message);
 	void onMessageReceived(const QByteArray &data);
+	void onHandshakeTimeout();
 	void onDisconnected();
 
 private:
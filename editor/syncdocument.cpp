@@ -1,212 +1,533 @@
 #include "syncdocument.h"
+#include "gzipdevice.h"
 #include <QFile>
+#include <QFutureInterface>
 #include <QMessageBox>
-#include <QDomDocument>
-#include <QTextStream>
+#include <QRunnable>
+#include <QThreadPool>
+#include <QtConcurrentMap>
+#include <QXmlStreamReader>
+#include <QXmlStreamWriter>
 
 #if (QT_VERSION >= QT_VERSION_CHECK(5, 1, 0))
 #include <QSaveFile>
 #define USE_QSAVEFILE
 #endif
 
+enum { PARALLEL_LOAD_SIZE = 1 << 20 };
+
 SyncDocument::~SyncDocument()
 {
+	closeJournal();
 	for (int i = 0; i < tracks.size(); ++i)
 		delete tracks[i];
 }
 
 SyncTrack *SyncDocument::createTrack(const QString &name)
 {
-	QStringList parts = name.split(':');
+	int separator = name.indexOf(':');
 	SyncPage *page = defaultSyncPage;
 	QString visibleName = name;
-	if (parts.size() > 1) {
-		page = findSyncPage(parts[0]);
+	if (separator >= 0) {
+		QString pageName = name.left(separator);
+		page = findSyncPage(pageName);
 		if (!page)
-			page = createSyncPage(parts[0]);
-		visibleName = name.right(name.length() - parts[0].length() - 1);
+			page = createSyncPage(pageName);
+		visibleName = name.mid(separator + 1);
 	}
 
 	SyncTrack *t = new SyncTrack(name, visibleName);
+	if (batchDepth)
+		t->beginBatch();
+	trackIndices.insert(name, tracks.size());
 	tracks.append(t);
 	page->addTrack(t);
+	QObject::connect(t,    SIGNAL(keysChanged(const SyncTrack::KeyChanges &)),
+	                 this, SLOT(onTrackKeysChanged(const SyncTrack::KeyChanges &)));
 	return t;
 }
 
-SyncDocument *SyncDocument::load(const QString &fileName)
+void SyncDocument::onTrackKeysChanged(const SyncTrack::KeyChanges &changes)
+{
+	SyncTrack *t = qobject_cast<SyncTrack *>(sender());
+	dirtyTracks.insert(t);
+	if (journal)
+		journal->appendKeys(t, changes);
+}
+
+// the keys of the track element the stream is at, up to its end tag
+static void readTrackKeys(QXmlStreamReader &stream, QVector<SyncTrack::TrackKey> *keys)
+{
+	while (stream.readNextStartElement()) {
+		if (stream.name() == "key") {
+			QXmlStreamAttributes attribs = stream.attributes();
+			SyncTrack::TrackKey k;
+			k.row = attribs.value("row").toString().toInt();
+			k.value = attribs.value("value").toString().toFloat();
+			k.type = SyncTrack::TrackKey::KeyType(attribs.value("interpolation").toString().toInt());
+			keys->append(k);
+		}
+		stream.skipCurrentElement();
+	}
+}
+
+// one element at a time, so only the document itself grows with the file
+static void readDocument(QXmlStreamReader &stream, SyncDocument *doc)
+{
+	while (!stream.atEnd()) {
+		if (stream.readNext() != QXmlStreamReader::StartElement)
+			continue;
+
+		QXmlStreamAttributes attribs = stream.attributes();
+		if (stream.name() == "sync") {
+			if (attribs.hasAttribute("rows"))
+				doc->setRows(attribs.value("rows").toString().toInt());
+		} else if (stream.name() == "track") {
+			QString name = attribs.value("name").toString();
+
+			// look up track-name, create it if it doesn't exist
+			SyncTrack *t = doc->findTrack(name);
+			if (!t)
+				t = doc->createTrack(name);
+
+			// all of the track's keys go in at once
+			QVector<SyncTrack::TrackKey> keys = t->getKeys();
+			readTrackKeys(stream, &keys);
+			t->loadKeys(keys);
+		} else if (stream.name() == "bookmark") {
+			int row = attribs.value("row").toString().toInt();
+			doc->toggleRowBookmark(row);
+		}
+	}
+}
+
+struct ParsedTrack {
+	QString name;
+	QVector<SyncTrack::TrackKey> keys;
+	bool ok;
+};
+
+static ParsedTrack parseTrack(const QByteArray &element)
+{
+	ParsedTrack ret;
+	QXmlStreamReader stream(element);
+	ret.ok = stream.readNextStartElement() && stream.name() == "track";
+	if (ret.ok) {
+		ret.name = stream.attributes().value("name").toString();
+		readTrackKeys(stream, &ret.keys);
+	}
+
+	// and nothing after it
+	while (!stream.atEnd())
+		stream.readNext();
+	ret.ok = ret.ok && !stream.hasError();
+	return ret;
+}
+
+/* cuts the track elements out with a plain byte search and parses them
+ * on the thread pool, the rest of the document here; NULL for anything
+ * the search might get wrong, which the streaming loader then handles */
+static SyncDocument *loadParallel(QFile &file)
 {
+	qint64 size = file.size();
+	const char *data = reinterpret_cast<const char *>(file.map(0, size));
+	QByteArray buffer;
+	if (!data) {
+		buffer = file.readAll();
+		data = buffer.constData();
+		size = buffer.size();
+	}
+	if (size > INT_MAX)
+		return NULL;
+
+	QByteArray bytes = QByteArray::fromRawData(data, int(size));
+	if (bytes.contains("<!--") || bytes.contains("<![CDATA["))
+		return NULL;
+
+	QVector<QByteArray> elements;
+	QByteArray skeleton;
+	int pos = 0, prevEnd = 0;
+	while ((pos = bytes.indexOf("<track", pos)) >= 0) {
+		int tagEnd = bytes.indexOf('>', pos);
+		if (tagEnd < 0)
+			return NULL;
+
+		// not <tracks>
+		char c = bytes.at(pos + 6);
+		if (c != ' ' && c != '\t' && c != '\r' && c != '\n' && c != '/' && c != '>') {
+			pos = tagEnd;
+			continue;
+		}
+
+		int end = tagEnd + 1;
+		if (bytes.at(tagEnd - 1) != '/') {
+			end = bytes.indexOf("</track>", tagEnd);
+			if (end < 0)
+				return NULL;
+			end += 8;
+		}
+
+		skeleton += bytes.mid(prevEnd, pos - prevEnd);
+		elements.append(QByteArray::fromRawData(data + pos, end - pos));
+		pos = prevEnd = end;
+	}
+	skeleton += bytes.mid(prevEnd);
+
+	// in the order of the file, however the pool got through them
+	QVector<ParsedTrack> tracks =
+	    QtConcurrent::blockingMapped<QVector<ParsedTrack> >(elements, parseTrack);
+	for (int i = 0; i < tracks.size(); ++i)
+		if (!tracks[i].ok)
+			return NULL;
+
 	SyncDocument *ret = new SyncDocument;
-	ret->fileName = fileName;
+	ret->fileName = file.fileName();
+
+	QXmlStreamReader stream(skeleton);
+	readDocument(stream, ret);
+	if (stream.hasError()) {
+		delete ret;
+		return NULL;
+	}
 
+	for (int i = 0; i < tracks.size(); ++i) {
+		SyncTrack *t = ret->findTrack(tracks[i].name);
+		if (t)
+			t->loadKeys(t->getKeys() + tracks[i].keys);
+		else
+			ret->createTrack(tracks[i].name)->loadKeys(tracks[i].keys);
+	}
+	return ret;
+}
+
+SyncDocument *SyncDocument::load(const QString &fileName)
+{
 	QFile file(fileName);
 	if (!file.open(QIODevice::ReadOnly)) {
 		QMessageBox::critical(NULL, "Error", file.errorString());
 		return NULL;
 	}
 
-	QDomDocument doc;
-	QString err;
-	if (!doc.setContent(&file, &err)) {
-		file.close();
-		QMessageBox::critical(NULL, "Error", err);
+	if (file.peek(4) == "RKTB")
+		return loadBinary(file);
+
+	// compressed files stream through zlib, whatever they're called
+	GzipDevice gzip(&file);
+	bool compressed = GzipDevice::isGzip(&file);
+	if (compressed && !gzip.open(QIODevice::ReadOnly)) {
+		QMessageBox::critical(NULL, "Error", gzip.errorString());
 		return NULL;
 	}
-	file.close();
 
-	QDomNamedNodeMap attribs = doc.documentElement().attributes();
-	QDomNode rowsParam = attribs.namedItem("rows");
-	if (!rowsParam.isNull()) {
-		QString rowsString = rowsParam.nodeValue();
-		ret->setRows(rowsString.toInt());
-	}
-
-	QDomNodeList trackNodes =
-	    doc.documentElement().elementsByTagName("track");
-	for (int i = 0; i < trackNodes.count(); ++i) {
-		QDomNode trackNode = trackNodes.item(i);
-		QDomNamedNodeMap attribs = trackNode.attributes();
-
-		QString name = attribs.namedItem("name").nodeValue();
-
-		// look up track-name, create it if it doesn't exist
-		SyncTrack *t = ret->findTrack(name.toUtf8());
-		if (!t)
-			t = ret->createTrack(name.toUtf8().constData());
-
-		QDomNodeList rowNodes = trackNode.childNodes();
-		for (int i = 0; i < rowNodes.count(); ++i) {
-			QDomNode keyNode = rowNodes.item(i);
-			QString baseName = keyNode.nodeName();
-			if (baseName == "key") {
-				QDomNamedNodeMap rowAttribs = keyNode.attributes();
-				QString rowString = rowAttribs.namedItem("row").nodeValue();
-				QString valueString = rowAttribs.namedItem("value").nodeValue();
-				QString interpolationString = rowAttribs.namedItem("interpolation").nodeValue();
-
-				SyncTrack::TrackKey k;
-				k.row = rowString.toInt();
-				k.value = valueString.toFloat();
-				k.type = SyncTrack::TrackKey::KeyType(interpolationString.toInt());
-
-				Q_ASSERT(!t->isKeyFrame(k.row));
-				t->setKey(k);
-			}
-		}
+	// where there's enough to share out between cores
+	if (!compressed && file.size() >= PARALLEL_LOAD_SIZE) {
+		SyncDocument *ret = loadParallel(file);
+		if (ret)
+			return ret;
+		file.seek(0);
+	}
+
+	SyncDocument *ret = new SyncDocument;
+	ret->fileName = fileName;
+	ret->compressed = compressed;
+
+	QXmlStreamReader stream(compressed ? static_cast<QIODevice *>(&gzip) : &file);
+	readDocument(stream, ret);
+	if (stream.hasError()) {
+		QMessageBox::critical(NULL, "Error",
+		                      QString("%1:%2: %3").arg(fileName)
+		                      .arg(stream.lineNumber())
+		                      .arg(stream.errorString()));
+		delete ret;
+		return NULL;
 	}
 
-	// YUCK: gathers from entire document
-	QDomNodeList bookmarkNodes =
-	    doc.documentElement().elementsByTagName("bookmark");
-	for (int i = 0; i < bookmarkNodes.count(); ++i) {
-		QDomNode bookmarkNode =
-		    bookmarkNodes.item(i);
-		QDomNamedNodeMap bookmarkAttribs =
-		    bookmarkNode.attributes();
-		QString str =
-		    bookmarkAttribs.namedItem("row").nodeValue();
-		int row = str.toInt();
-		ret->toggleRowBookmark(row);
+	// the XML may end before the stream does; the checksum comes last
+	if (compressed) {
+		char rest[4096];
+		while (gzip.read(rest, sizeof(rest)) > 0)
+			;
+		if (gzip.hasError()) {
+			QMessageBox::critical(NULL, "Error",
+			                      QString("%1: %2").arg(fileName)
+			                      .arg(gzip.errorString()));
+			delete ret;
+			return NULL;
+		}
 	}
 
 	return ret;
 }
 
-static QDomElement serializeTrack(QDomDocument &doc, const SyncTrack *t)
+/* six significant digits, as always, unless that would read back as a
+ * different float; nine always do */
+static QString formatValue(float value)
 {
-	QDomElement trackElem = doc.createElement("track");
-	trackElem.setAttribute("name", t->getName());
-
-	QMap<int, SyncTrack::TrackKey> keyMap = t->getKeyMap();
-	QMap<int, SyncTrack::TrackKey>::const_iterator it;
-	for (it = keyMap.constBegin(); it != keyMap.constEnd(); ++it) {
-		int row = it.key();
-		float value = it->value;
-		char interpolationType = char(it->type);
-
-		QDomElement keyElem = doc.createElement("key");
-
-		keyElem.setAttribute("row", row);
-		keyElem.setAttribute("value", value);
-		keyElem.setAttribute("interpolation", (int)interpolationType);
+	QString text = QString::number(value);
+	if (text.toFloat() != value)
+		text = QString::number(value, 'g', 9);
+	return text;
+}
 
-		trackElem.appendChild(doc.createTextNode("\n\t\t\t"));
-		trackElem.appendChild(keyElem);
+static void serializeTrack(QXmlStreamWriter &stream, const QString &name,
+                           const QVector<SyncTrack::TrackKey> &keys)
+{
+	stream.writeStartElement("track");
+	stream.writeAttribute("name", name);
+
+	// attributes in the order QDom used to write them
+	QVector<SyncTrack::TrackKey>::const_iterator it;
+	for (it = keys.constBegin(); it != keys.constEnd(); ++it) {
+		stream.writeCharacters("\n\t\t\t");
+		stream.writeEmptyElement("key");
+		stream.writeAttribute("row", QString::number(it->row));
+		stream.writeAttribute("interpolation", QString::number(int(it->type)));
+		stream.writeAttribute("value", formatValue(it->value));
 	}
 
-	if (keyMap.size())
-		trackElem.appendChild(doc.createTextNode("\n\t\t"));
+	if (!keys.isEmpty())
+		stream.writeCharacters("\n\t\t");
 
-	return trackElem;
+	stream.writeEndElement();
 }
 
-bool SyncDocument::save(const QString &fileName)
-{
-	QDomDocument doc;
-	QDomElement rootNode = doc.createElement("sync");
-	rootNode.setAttribute("rows", getRows());
-	doc.appendChild(rootNode);
+/* everything a save writes, copied out so another thread can write it
+ * while editing goes on; the key vectors are implicitly shared */
+struct DocumentSnapshot {
+	bool compressed;
+	int rows;
+	QList<int> bookmarks;
+	QVector<QPair<QString, QVector<SyncTrack::TrackKey> > > tracks;
+};
 
-	rootNode.appendChild(doc.createTextNode("\n\t"));
-	QDomElement tracksNode =
-	    doc.createElement("tracks");
-	for (int i = 0; i < getSyncPageCount(); i++) {
-		SyncPage *page = getSyncPage(i);
+static DocumentSnapshot takeSnapshot(SyncDocument *doc)
+{
+	DocumentSnapshot snapshot;
+	snapshot.compressed = false;
+	snapshot.rows = doc->getRows();
+	snapshot.bookmarks = doc->getRowBookmarks();
+	for (int i = 0; i < doc->getSyncPageCount(); i++) {
+		SyncPage *page = doc->getSyncPage(i);
 		for (int j = 0; j < page->getTrackCount(); ++j) {
 			const SyncTrack *t = page->getTrack(j);
-			QDomElement trackElem = serializeTrack(doc, t);
-
-			tracksNode.appendChild(doc.createTextNode("\n\t\t"));
-			tracksNode.appendChild(trackElem);
+			snapshot.tracks.append(qMakePair(t->getName(), t->getKeys()));
 		}
 	}
-	if (getTrackCount())
-		tracksNode.appendChild(doc.createTextNode("\n\t"));
-	rootNode.appendChild(tracksNode);
-	rootNode.appendChild(doc.createTextNode("\n\t"));
-
-	QDomElement bookmarksNode =
-	    doc.createElement("bookmarks");
-	QList<int>::const_iterator it;
-	for (it = rowBookmarks.begin(); it != rowBookmarks.end(); ++it) {
-		QDomElement bookmarkElem =
-		    doc.createElement("bookmark");
-		bookmarkElem.setAttribute("row", *it);
-
-		bookmarksNode.appendChild(
-		    doc.createTextNode("\n\t\t"));
-		bookmarksNode.appendChild(bookmarkElem);
-	}
-	if (0 != rowBookmarks.size())
-		bookmarksNode.appendChild(
-		    doc.createTextNode("\n\t"));
-	rootNode.appendChild(bookmarksNode);
-	rootNode.appendChild(doc.createTextNode("\n"));
+	return snapshot;
+}
 
+// an error message, or an empty string once the file is in place
+static QString writeXml(const QString &fileName, const DocumentSnapshot &snapshot,
+                        QFutureInterface<QString> *progress)
+{
 #ifdef USE_QSAVEFILE
 	QSaveFile file(fileName);
 #else
 	QFile file(fileName);
 #endif
 
-	if (!file.open(QIODevice::WriteOnly | QIODevice::Text)) {
-		QMessageBox::critical(NULL, "Error", file.errorString());
-		return false;
+	// line endings are for the text, not the compressed bytes
+	GzipDevice gzip(&file);
+	QIODevice *device = &file;
+	if (!file.open(snapshot.compressed ? QIODevice::WriteOnly : QIODevice::WriteOnly | QIODevice::Text))
+		return file.errorString();
+	if (snapshot.compressed) {
+		if (!gzip.open(QIODevice::WriteOnly | QIODevice::Text))
+			return gzip.errorString();
+		device = &gzip;
+	}
+
+	if (progress)
+		progress->setProgressRange(0, snapshot.tracks.size());
+
+	// no XML declaration, and the whitespace is ours
+	QXmlStreamWriter stream(device);
+	stream.writeStartElement("sync");
+	stream.writeAttribute("rows", QString::number(snapshot.rows));
+
+	stream.writeCharacters("\n\t");
+	stream.writeStartElement("tracks");
+	for (int i = 0; i < snapshot.tracks.size(); ++i) {
+		stream.writeCharacters("\n\t\t");
+		serializeTrack(stream, snapshot.tracks[i].first, snapshot.tracks[i].second);
+		if (progress)
+			progress->setProgressValue(i + 1);
+	}
+	if (!snapshot.tracks.isEmpty())
+		stream.writeCharacters("\n\t");
+	stream.writeEndElement();
+
+	stream.writeCharacters("\n\t");
+	stream.writeStartElement("bookmarks");
+	QList<int>::const_iterator it;
+	for (it = snapshot.bookmarks.begin(); it != snapshot.bookmarks.end(); ++it) {
+		stream.writeCharacters("\n\t\t");
+		stream.writeEmptyElement("bookmark");
+		stream.writeAttribute("row", QString::number(*it));
+	}
+	if (0 != snapshot.bookmarks.size())
+		stream.writeCharacters("\n\t");
+	stream.writeEndElement();
+
+	stream.writeCharacters("\n");
+	stream.writeEndElement();
+	stream.writeCharacters("\n");
+
+	bool ok = !stream.hasError();
+	if (snapshot.compressed) {
+		gzip.close();
+		if (gzip.hasError())
+			return gzip.errorString();
 	}
-	QTextStream streamFileOut(&file);
-	streamFileOut.setCodec("UTF-8");
-	streamFileOut << doc.toString();
-	streamFileOut.flush();
 
 #ifdef USE_QSAVEFILE
-	file.commit();
+	ok = ok && file.commit();
 #else
 	file.close();
+	ok = ok && file.error() == QFile::NoError;
 #endif
 
+	return ok ? QString() : file.errorString();
+}
+
+/* writes a snapshot on the global thread pool, reporting per track */
+class SaveTask : public QRunnable {
+public:
+	SaveTask(const QString &fileName, const DocumentSnapshot &snapshot) :
+	    fileName(fileName),
+	    snapshot(snapshot)
+	{
+	}
+
+	QFuture<QString> start()
+	{
+		result.reportStarted();
+		QFuture<QString> future = result.future();
+		QThreadPool::globalInstance()->start(this); // deletes us when done
+		return future;
+	}
+
+	void run()
+	{
+		QString error = writeXml(fileName, snapshot, &result);
+		result.reportResult(error);
+		result.reportFinished();
+	}
+
+private:
+	QString fileName;
+	DocumentSnapshot snapshot;
+	QFutureInterface<QString> result;
+};
+
+bool SyncDocument::save(const QString &fileName)
+{
+	bool ok = fileName.endsWith(".rocketb", Qt::CaseInsensitive) ?
+	          saveBinary(fileName) : saveXml(fileName);
+
+	// the file has everything now, so start over against it
+	if (ok)
+		startJournal(fileName);
+	return ok;
+}
+
+bool SyncDocument::saveXml(const QString &fileName)
+{
+	DocumentSnapshot snapshot = takeSnapshot(this);
+	snapshot.compressed = saveCompressed(fileName);
+	QString error = writeXml(fileName, snapshot, NULL);
+	if (!error.isEmpty()) {
+		QMessageBox::critical(NULL, "Error", error);
+		return false;
+	}
+
+	compressed = snapshot.compressed;
 	undoStack.setClean();
 	return true;
 }
 
+QFuture<QString> SyncDocument::saveInBackground(const QString &fileName)
+{
+	savedEditCount = editCount;
+	if (journal)
+		journal->beginCheckpoint();
+
+	DocumentSnapshot snapshot = takeSnapshot(this);
+	snapshot.compressed = savingCompressed = saveCompressed(fileName);
+	return (new SaveTask(fileName, snapshot))->start();
+}
+
+void SyncDocument::saveFinished(const QString &fileName, bool ok)
+{
+	if (!ok) {
+		if (journal)
+			journal->endCheckpoint();
+		return;
+	}
+
+	compressed = savingCompressed;
+
+	// anything edited since the snapshot is still unsaved
+	if (editCount == savedEditCount)
+		undoStack.setClean();
+
+	// and stays in the journal, now against the new file
+	if (!journal || !journal->rebase(fileName))
+		startJournal(fileName);
+}
+
+void SyncDocument::startJournal(const QString &documentName)
+{
+	discardJournal();
+	journal = new SyncJournal(this, documentName);
+	if (!journal->create()) {
+		delete journal;
+		journal = NULL;
+	}
+}
+
+bool SyncDocument::recoverJournal()
+{
+	delete journal;
+	journal = NULL;
+
+	// nothing replayed may go back into the journal it came from
+	SyncJournal *recovered = new SyncJournal(this, fileName);
+	if (!recovered->replay()) {
+		delete recovered;
+		startJournal(fileName);
+		return false;
+	}
+
+	journal = recovered;
+	return true;
+}
+
+void SyncDocument::closeJournal()
+{
+	// a clean document is what's on disk, there's nothing to recover
+	if (journal && !isModified())
+		journal->remove();
+	delete journal;
+	journal = NULL;
+}
+
+void SyncDocument::discardJournal()
+{
+	if (journal) {
+		journal->remove();
+		delete journal;
+		journal = NULL;
+	}
+}
+
+void SyncDocument::setRows(int rows)
+{
+	this->rows = rows;
+	if (journal)
+		journal->appendRows(rows);
+}
+
 bool SyncDocument::isRowBookmark(int row) const
 {
 	QList<int>::const_iterator it = qLowerBound(rowBookmarks.begin(), rowBookmarks.end(), row);
@@ -220,6 +541,9 @@ void SyncDocument::toggleRowBookmark(int row)
 		rowBookmarks.insert(it, row);
 	else
 		rowBookmarks.erase(it);
+
+	if (journal)
+		journal->appendBookmark(row);
 }
 
 int SyncDocument::prevRowBookmark(int row) const
@@ -238,104 +562,133 @@ int SyncDocument::nextRowBookmark(int row) const
 	return *it;
 }
 
-class InsertCommand : public QUndoCommand
+void SyncDocument::beginBatch()
+{
+	if (!batchDepth++)
+		for (int i = 0; i < tracks.size(); ++i)
+			tracks[i]->beginBatch();
+}
+
+void SyncDocument::endBatch()
+{
+	Q_ASSERT(batchDepth > 0);
+	if (!--batchDepth)
+		for (int i = 0; i < tracks.size(); ++i)
+			tracks[i]->endBatch();
+}
+
+/*
+ * Replaces the keys of one track inside a range of rows, remembering the
+ * keys it replaced; a whole paste or clear is one of these per track.
+ */
+class KeysCommand : public QUndoCommand
 {
 public:
-	InsertCommand(SyncTrack *track, const SyncTrack::TrackKey &key, QUndoCommand *parent = 0) :
-	    QUndoCommand("insert", parent),
+	KeysCommand(SyncTrack *track, int start, int stop,
+	            const QVector<SyncTrack::TrackKey> &keys, QUndoCommand *parent = 0) :
+	    QUndoCommand(parent),
 	    track(track),
-	    key(key)
+	    start(start),
+	    stop(stop),
+	    oldKeys(track->getKeys(start, stop)),
+	    newKeys(keys),
+	    expired(false)
 	{}
 
 	virtual void redo()
 	{
-		Q_ASSERT(!track->isKeyFrame(key.row));
-		track->setKey(key);
+		Q_ASSERT(!expired);
+		track->replaceKeys(start, stop, newKeys);
 	}
 
 	virtual void undo()
 	{
-		Q_ASSERT(track->isKeyFrame(key.row));
-		track->removeKey(key.row);
+		Q_ASSERT(!expired);
+		track->replaceKeys(start, stop, oldKeys);
 	}
 
-private:
-	SyncTrack *track;
-	SyncTrack::TrackKey key;
-};
-
-class DeleteCommand : public QUndoCommand
-{
-public:
-	DeleteCommand(SyncTrack *track, int row, QUndoCommand *parent = 0) :
-	    QUndoCommand("delete", parent),
-	    track(track),
-	    row(row),
-	    oldKey(track->getKeyFrame(row))
-	{}
-
-	virtual void redo()
+	qint64 memoryUsage() const
 	{
-		Q_ASSERT(track->isKeyFrame(row));
-		Q_ASSERT(oldKey.row == row);
-		Q_ASSERT(track->getKeyFrame(row) == oldKey);
-		track->removeKey(row);
+		return sizeof(*this) +
+		       (oldKeys.capacity() + newKeys.capacity()) * sizeof(SyncTrack::TrackKey);
 	}
 
-	virtual void undo()
+	// give the keys back, once we can't be undone any more
+	void expire()
 	{
-		Q_ASSERT(!track->isKeyFrame(row));
-		Q_ASSERT(oldKey.row == row);
-		track->setKey(oldKey);
+		oldKeys = QVector<SyncTrack::TrackKey>();
+		newKeys = QVector<SyncTrack::TrackKey>();
+		expired = true;
 	}
 
 private:
 	SyncTrack *track;
-	int row;
-	SyncTrack::TrackKey oldKey;
+	int start, stop;
+	QVector<SyncTrack::TrackKey> oldKeys, newKeys;
+	bool expired;
 };
 
-
-class EditCommand : public QUndoCommand
+static qint64 commandMemoryUsage(const QUndoCommand *cmd)
 {
-public:
-	EditCommand(SyncTrack *track, const SyncTrack::TrackKey &key, QUndoCommand *parent = 0) :
-	    QUndoCommand("edit", parent),
-	    track(track),
-	    oldKey(track->getKeyFrame(key.row)),
-	    key(key)
-	{}
+	const KeysCommand *keysCmd = dynamic_cast<const KeysCommand *>(cmd);
+	qint64 ret = keysCmd ? keysCmd->memoryUsage() : sizeof(*cmd);
+	for (int i = 0; i < cmd->childCount(); ++i)
+		ret += commandMemoryUsage(cmd->child(i));
+	return ret;
+}
 
-	virtual void redo()
-	{
-		Q_ASSERT(track->isKeyFrame(key.row));
-		Q_ASSERT(key.row == oldKey.row);
-		Q_ASSERT(track->getKeyFrame(key.row) == oldKey);
-		track->setKey(key);
-	}
+static void expireCommand(const QUndoCommand *cmd)
+{
+	KeysCommand *keysCmd = dynamic_cast<KeysCommand *>(const_cast<QUndoCommand *>(cmd));
+	if (keysCmd)
+		keysCmd->expire();
+	for (int i = 0; i < cmd->childCount(); ++i)
+		expireCommand(cmd->child(i));
+}
 
-	virtual void undo()
-	{
-		Q_ASSERT(track->isKeyFrame(oldKey.row));
-		Q_ASSERT(key.row == oldKey.row);
-		Q_ASSERT(track->getKeyFrame(key.row) == key);
-		track->setKey(oldKey);
-	}
+void SyncDocument::replaceKeys(SyncTrack *track, int start, int stop,
+                               const QVector<SyncTrack::TrackKey> &keys)
+{
+	// nothing to replace, and nothing to undo
+	if (keys.isEmpty() && track->lowerBound(start) == track->lowerBound(stop + 1))
+		return;
 
-private:
-	SyncTrack *track;
-	SyncTrack::TrackKey oldKey, key;
-};
+	undoStack.push(new KeysCommand(track, start, stop, keys));
+	if (!batchDepth)
+		addUndoStep();
+}
 
 void SyncDocument::setKeyFrame(SyncTrack *track, const SyncTrack::TrackKey &key)
 {
-	if (track->isKeyFrame(key.row))
-		undoStack.push(new EditCommand(track, key));
-	else
-		undoStack.push(new InsertCommand(track, key));
+	replaceKeys(track, key.row, key.row, QVector<SyncTrack::TrackKey>() << key);
 }
 
 void SyncDocument::deleteKeyFrame(SyncTrack *track, int row)
 {
-	undoStack.push(new DeleteCommand(track, row));
+	replaceKeys(track, row, row, QVector<SyncTrack::TrackKey>());
+}
+
+void SyncDocument::addUndoStep()
+{
+	// the new step went on top, in place of any steps that were undone
+	int step = undoStack.count() - 1;
+	Q_ASSERT(step >= expiredSteps && step <= stepMemory.size());
+	for (int i = step; i < stepMemory.size(); ++i)
+		undoMemory -= stepMemory[i];
+	stepMemory.resize(step);
+
+	stepMemory.append(commandMemoryUsage(undoStack.command(step)));
+	undoMemory += stepMemory.last();
+	trimUndoStack();
+}
+
+void SyncDocument::trimUndoStack()
+{
+	// QUndoStack can only limit the number of steps, so the oldest steps
+	// past the limit drop their keys instead, and are never undone again
+	while (undoMemory > undoMemoryLimit && expiredSteps < undoStack.index()) {
+		expireCommand(undoStack.command(expiredSteps));
+		undoMemory -= stepMemory[expiredSteps];
+		stepMemory[expiredSteps++] = 0;
+	}
 }
@@ -2,6 +2,10 @@
 #define SYNCDOCUMENT_H
 
 #include <QStack>
+#include <QDateTime>
+#include <QFuture>
+#include <QHash>
+#include <QSet>
 #include <QList>
 #include <QVector>
 #include <QString>
@@ -11,16 +15,30 @@
 
 #include "synctrack.h"
 #include "syncpage.h"
+#include "syncjournal.h"
+
+class QFile;
 
 class SyncDocument : public QObject {
 	Q_OBJECT
 public:
 	SyncDocument() :
-	    rows(128)
+	    rows(128),
+	    batchDepth(0),
+	    undoMemoryLimit(Q_INT64_C(256) << 20),
+	    expiredSteps(0),
+	    undoMemory(0),
+	    editCount(0),
+	    savedEditCount(0),
+	    compressed(false),
+	    savingCompressed(false),
+	    journal(NULL)
 	{
 		defaultSyncPage = createSyncPage("default");
 		QObject::connect(&undoStack, SIGNAL(cleanChanged(bool)),
 		                 this,       SLOT(onCleanChanged(bool)));
+		QObject::connect(&undoStack, SIGNAL(indexChanged(int)),
+		                 this,       SLOT(onIndexChanged()));
 	}
 
 	~SyncDocument();
@@ -35,10 +53,8 @@ public:
 
 	SyncTrack *findTrack(const QString &name)
 	{
-		for (int i = 0; i < tracks.size(); ++i)
-			if (name == tracks[i]->getName())
-				return tracks[i];
-		return NULL;
+		int index = trackIndices.value(name, -1);
+		return index >= 0 ? tracks[index] : NULL;
 	}
 
 	int getTrackCount() const
@@ -46,25 +62,67 @@ public:
 		return tracks.size();
 	}
 
-	void undo() { undoStack.undo(); }
-	void redo() { undoStack.redo(); }
+	void undo()
+	{
+		if (!canUndo())
+			return;
+		beginBatch();
+		undoStack.undo();
+		endBatch();
+	}
+
+	void redo() { beginBatch(); undoStack.redo(); endBatch(); }
+
 	bool isModified() const { return !undoStack.isClean(); }
-	bool canUndo () const { return undoStack.canUndo();  }
+	bool canUndo () const { return undoStack.index() > expiredSteps; }
 	bool canRedo () const { return undoStack.canRedo();  }
 
-	void beginMacro(const QString &text) { undoStack.beginMacro(text); }
+	/* the tracks report all changes of a macro in one go at the end */
+	void beginMacro(const QString &text) { beginBatch(); undoStack.beginMacro(text); }
 	void setKeyFrame(SyncTrack *track, const SyncTrack::TrackKey &key);
 	void deleteKeyFrame(SyncTrack *track, int row);
-	void endMacro() { undoStack.endMacro(); }
+	void replaceKeys(SyncTrack *track, int start, int stop,
+	                 const QVector<SyncTrack::TrackKey> &keys);
+	void endMacro()
+	{
+		undoStack.endMacro();
+		endBatch();
+		if (!batchDepth)
+			addUndoStep();
+	}
+
+	/* the oldest steps are forgotten once the history takes more */
+	void setUndoMemoryLimit(qint64 bytes) { undoMemoryLimit = bytes; trimUndoStack(); }
 
+	/* XML, or the binary format when the file name ends in .rocketb;
+	 * XML is gzipped for names ending in .gz, and to the file it came
+	 * from when that was */
 	static SyncDocument *load(const QString &fileName);
 	bool save(const QString &fileName);
 
+	/* XML only: writes a snapshot on the thread pool and keeps editing
+	 * going; the future reports progress per track and an error message,
+	 * empty on success, to be handed back through saveFinished() */
+	QFuture<QString> saveInBackground(const QString &fileName);
+	void saveFinished(const QString &fileName, bool ok);
+
+	/* every change after a save or load also goes to a journal next to
+	 * the file, to be recovered after a crash */
+	bool hasRecoverableJournal() const
+	{
+		return !fileName.isEmpty() && SyncJournal::isRecoverable(fileName);
+	}
+	void startJournal(const QString &documentName);
+	bool recoverJournal();
+	void closeJournal(); // left on disk if modified, for a later recovery
+	void discardJournal();
+
 	bool isRowBookmark(int row) const;
 	void toggleRowBookmark(int row);
+	const QList<int> &getRowBookmarks() const { return rowBookmarks; }
 
 	int getRows() const { return rows; }
-	void setRows(int rows) { this->rows = rows; }
+	void setRows(int rows);
 
 	QString fileName;
 
@@ -73,15 +131,13 @@ public:
 
 	SyncPage *findSyncPage(const QString &name)
 	{
-		for (int i = 0; i < syncPages.size(); ++i)
-			if (name == syncPages[i]->getName())
-				return syncPages[i];
-		return NULL;
+		return syncPageIndices.value(name, NULL);
 	}
 
 	SyncPage *createSyncPage(const QString &name)
 	{
 		SyncPage *syncPage = new SyncPage(this, name);
+		syncPageIndices.insert(name, syncPage);
 		syncPages.append(syncPage);
 
 		emit syncPageAdded(syncPage);
@@ -100,13 +156,61 @@ public:
 	}
 
 private:
+	void beginBatch();
+	void endBatch();
+	void addUndoStep();
+	void trimUndoStack();
+
+	static SyncDocument *loadBinary(QFile &file);
+	bool readBinary(const uchar *data, qint64 size, QString *error);
+	bool saveXml(const QString &fileName);
+	bool saveCompressed(const QString &fileName) const
+	{
+		return fileName.endsWith(".gz", Qt::CaseInsensitive) ||
+		       (compressed && fileName == this->fileName);
+	}
+	bool saveBinary(const QString &fileName);
+	bool updateBinary();
+	QVector<const SyncTrack *> getTracksInPageOrder() const;
+
 	QList<SyncTrack*> tracks;
+	QHash<QString, int> trackIndices;
 	QList<int> rowBookmarks;
 	QList<SyncPage*> syncPages;
+	QHash<QString, SyncPage *> syncPageIndices;
 	SyncPage *defaultSyncPage;
 	int rows;
+	int batchDepth;
 
 	QUndoStack undoStack;
+	qint64 undoMemoryLimit;
+	int expiredSteps;
+
+	/* what each step of the undo stack holds on to, and their sum; zero
+	 * for the expired ones */
+	QVector<qint64> stepMemory;
+	qint64 undoMemory;
+	/* bumped by every push, undo and redo; unlike the stack index, an
+	 * undo followed by a new edit never gets back to an earlier count */
+	int editCount;
+	int savedEditCount; // when the background save started
+	bool compressed, savingCompressed;
+
+	/* where the binary file last read or written keeps everything, so a
+	 * save can rewrite just the tracks that changed since */
+	struct BinaryLayout {
+		QString fileName;
+		qint64 size;
+		QDateTime lastModified;
+		QVector<const SyncTrack *> tracks;
+		QVector<quint64> keyOffsets;
+		QVector<quint32> keyCapacities;
+		quint64 bookmarkOffset;
+		quint32 bookmarkCapacity;
+	} binaryLayout;
+	QSet<const SyncTrack *> dirtyTracks;
+
+	SyncJournal *journal;
 
 signals:
 	void syncPageAdded(SyncPage *page);
@@ -115,6 +219,8 @@ signals:
 
 private slots:
 	void onCleanChanged(bool clean) { emit modifiedChanged(!clean); }
+	void onIndexChanged() { ++editCount; }
+	void onTrackKeysChanged(const SyncTrack::KeyChanges &changes);
 };
 
 #endif // !defined(SYNCDOCUMENT_H)
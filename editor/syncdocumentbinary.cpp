@@ -0,0 +1,546 @@
+#include "syncdocument.h"
+#include <QFile>
+#include <QFileInfo>
+#include <QMessageBox>
+#include <QtEndian>
+
+#include <string.h>
+
+#ifdef Q_OS_WIN
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#if (QT_VERSION >= QT_VERSION_CHECK(5, 1, 0))
+#include <QSaveFile>
+#define USE_QSAVEFILE
+#endif
+
+/*
+ * Binary document layout, all little-endian:
+ *
+ *   header        magic "RKTB", version, rows, track count, page count,
+ *                 bookmark count and capacity, bookmark offset
+ *   track table   per track: name offset and size, key count, key offset
+ *                 and capacity; in page order, like the XML
+ *   page table    per page: name offset and size, track count
+ *   strings       UTF-8 names, referenced from the tables
+ *   keys          per track, 16-byte aligned arrays of row, value bits and
+ *                 interpolation type, with room to grow
+ *   bookmarks     sorted rows, with room to grow
+ *
+ * The key arrays have the same layout as SyncTrack::TrackKey, so loading
+ * copies them straight out of the mapped file, and the spare capacity lets
+ * a save rewrite changed tracks where they are.
+ *
+ * Such a save first writes all it is about to change to "<file>.update":
+ * magic "RKTU", the number of writes, each as file offset, size and bytes,
+ * and the qChecksum() of everything before it. Only once that is on disk
+ * does the file itself change, and the update file goes last, so a crash
+ * anywhere in between is finished off by the next load.
+ */
+
+enum {
+	BINARY_VERSION = 1,
+	HEADER_SIZE = 40,
+	TRACK_ENTRY_SIZE = 32,
+	PAGE_ENTRY_SIZE = 16,
+	KEY_SIZE = 12
+};
+
+Q_STATIC_ASSERT(sizeof(SyncTrack::TrackKey) == KEY_SIZE);
+
+static void put32(QByteArray &data, int pos, quint32 v)
+{
+	qToLittleEndian(v, reinterpret_cast<uchar *>(data.data() + pos));
+}
+
+static void put64(QByteArray &data, int pos, quint64 v)
+{
+	qToLittleEndian(v, reinterpret_cast<uchar *>(data.data() + pos));
+}
+
+static quint32 get32(const uchar *p)
+{
+	return qFromLittleEndian<quint32>(p);
+}
+
+static quint64 get64(const uchar *p)
+{
+	return qFromLittleEndian<quint64>(p);
+}
+
+static quint16 get16(const uchar *p)
+{
+	return qFromLittleEndian<quint16>(p);
+}
+
+static bool syncFile(QFile &file)
+{
+	if (!file.flush())
+		return false;
+#ifdef Q_OS_WIN
+	return _commit(file.handle()) == 0;
+#else
+	return fsync(file.handle()) == 0;
+#endif
+}
+
+static QString getUpdateFileName(const QString &fileName)
+{
+	return fileName + ".update";
+}
+
+typedef QPair<qint64, QByteArray> FilePatch;
+
+static bool writePatches(QFile &file, const QVector<FilePatch> &patches)
+{
+	for (int i = 0; i < patches.size(); ++i)
+		if (!file.seek(patches[i].first) ||
+		    file.write(patches[i].second) != patches[i].second.size())
+			return false;
+	return syncFile(file);
+}
+
+/* the rest of an in-place save that was cut short, if there is one; false
+ * if the file could not be brought up to date */
+static bool finishUpdate(const QString &fileName)
+{
+	QFile update(getUpdateFileName(fileName));
+	if (!update.exists())
+		return true;
+	if (!QFile::exists(fileName))
+		return update.remove();
+	if (!update.open(QIODevice::ReadOnly))
+		return false;
+	QByteArray data = update.readAll();
+	update.close();
+
+	// torn, so the file itself was never touched
+	const uchar *p = reinterpret_cast<const uchar *>(data.constData());
+	if (data.size() < 10 || !data.startsWith("RKTU") ||
+	    get16(p + data.size() - 2) != qChecksum(data.constData(), uint(data.size() - 2)))
+		return QFile::remove(update.fileName());
+
+	QVector<FilePatch> patches;
+	quint32 count = get32(p + 4);
+	int pos = 8;
+	for (quint32 i = 0; i < count; ++i) {
+		if (data.size() - 2 - pos < 12)
+			return false;
+		qint64 offset = qint64(get64(p + pos));
+		quint32 size = get32(p + pos + 8);
+		pos += 12;
+		if (size > quint32(data.size() - 2 - pos))
+			return false;
+		patches.append(FilePatch(offset, data.mid(pos, int(size))));
+		pos += int(size);
+	}
+
+	QFile file(fileName);
+	return file.open(QIODevice::ReadWrite) && writePatches(file, patches) &&
+	       QFile::remove(update.fileName());
+}
+
+static quint64 align16(quint64 offset)
+{
+	return (offset + 15) & ~quint64(15);
+}
+
+// a quarter more, so small edits don't move the track
+static quint32 slackCapacity(int count)
+{
+	return quint32(count + count / 4 + 16);
+}
+
+static QByteArray encodeKeys(const QVector<SyncTrack::TrackKey> &keys, quint32 capacity)
+{
+	QByteArray data(int(capacity * KEY_SIZE), '\0');
+#if Q_BYTE_ORDER == Q_LITTLE_ENDIAN
+	memcpy(data.data(), keys.constData(), keys.size() * KEY_SIZE);
+#else
+	for (int i = 0; i < keys.size(); ++i) {
+		union {
+			float f;
+			quint32 i;
+		} v;
+		v.f = keys[i].value;
+		put32(data, i * KEY_SIZE, quint32(keys[i].row));
+		put32(data, i * KEY_SIZE + 4, v.i);
+		put32(data, i * KEY_SIZE + 8, quint32(keys[i].type));
+	}
+#endif
+	return data;
+}
+
+static bool decodeKeys(const uchar *src, quint32 count, QVector<SyncTrack::TrackKey> *keys)
+{
+	keys->resize(int(count));
+#if Q_BYTE_ORDER == Q_LITTLE_ENDIAN
+	memcpy(keys->data(), src, count * KEY_SIZE);
+#else
+	for (quint32 i = 0; i < count; ++i) {
+		union {
+			float f;
+			quint32 i;
+		} v;
+		v.i = get32(src + i * KEY_SIZE + 4);
+		(*keys)[i].row = int(get32(src + i * KEY_SIZE));
+		(*keys)[i].value = v.f;
+		(*keys)[i].type = SyncTrack::TrackKey::KeyType(get32(src + i * KEY_SIZE + 8));
+	}
+#endif
+
+	// nothing to parse, but the file is still not to be trusted
+	for (quint32 i = 0; i < count; ++i) {
+		const SyncTrack::TrackKey &key = keys->at(int(i));
+		if (key.row < 0 || (i && key.row <= keys->at(int(i) - 1).row) ||
+		    quint32(key.type) >= SyncTrack::TrackKey::KEY_TYPE_COUNT)
+			return false;
+	}
+	return true;
+}
+
+QVector<const SyncTrack *> SyncDocument::getTracksInPageOrder() const
+{
+	QVector<const SyncTrack *> ret;
+	for (int i = 0; i < syncPages.size(); ++i) {
+		const SyncPage *page = syncPages[i];
+		for (int j = 0; j < page->getTrackCount(); ++j)
+			ret.append(page->getTrack(j));
+	}
+	return ret;
+}
+
+SyncDocument *SyncDocument::loadBinary(QFile &file)
+{
+	if (QFile::exists(getUpdateFileName(file.fileName()))) {
+		file.close();
+		if (!finishUpdate(file.fileName()) || !file.open(QIODevice::ReadOnly)) {
+			QMessageBox::critical(NULL, "Error",
+			                      QString("%1: An interrupted save could not be completed").arg(file.fileName()));
+			return NULL;
+		}
+	}
+
+	qint64 size = file.size();
+	const uchar *data = file.map(0, size);
+	QByteArray buffer;
+	if (!data) {
+		// not every file system can be mapped
+		buffer = file.readAll();
+		data = reinterpret_cast<const uchar *>(buffer.constData());
+		size = buffer.size();
+	}
+
+	SyncDocument *ret = new SyncDocument;
+	ret->fileName = file.fileName();
+
+	QString error;
+	if (!ret->readBinary(data, size, &error)) {
+		QMessageBox::critical(NULL, "Error",
+		                      QString("%1: %2").arg(file.fileName()).arg(error));
+		delete ret;
+		return NULL;
+	}
+
+	QFileInfo info(file);
+	ret->binaryLayout.fileName = file.fileName();
+	ret->binaryLayout.size = info.size();
+	ret->binaryLayout.lastModified = info.lastModified();
+	return ret;
+}
+
+bool SyncDocument::readBinary(const uchar *data, qint64 size, QString *error)
+{
+	quint64 fileSize = quint64(size);
+	if (fileSize < HEADER_SIZE || memcmp(data, "RKTB", 4)) {
+		*error = "Not a binary rocket file";
+		return false;
+	}
+
+	quint32 version = get32(data + 4);
+	if (version != BINARY_VERSION) {
+		*error = QString("Unsupported version %1").arg(version);
+		return false;
+	}
+
+	int rows = int(get32(data + 8));
+	quint32 trackCount = get32(data + 12);
+	quint32 pageCount = get32(data + 16);
+	quint32 bookmarkCount = get32(data + 20);
+	quint32 bookmarkCapacity = get32(data + 24);
+	quint64 bookmarkOffset = get64(data + 32);
+
+	quint64 trackTable = HEADER_SIZE;
+	quint64 pageTable = trackTable + quint64(trackCount) * TRACK_ENTRY_SIZE;
+	if (pageTable + quint64(pageCount) * PAGE_ENTRY_SIZE > fileSize ||
+	    bookmarkCount > bookmarkCapacity || bookmarkOffset > fileSize ||
+	    quint64(bookmarkCapacity) * 4 > fileSize - bookmarkOffset) {
+		*error = "Truncated file";
+		return false;
+	}
+
+	// pages first, so the empty ones survive too
+	for (quint32 i = 0; i < pageCount; ++i) {
+		const uchar *entry = data + pageTable + i * PAGE_ENTRY_SIZE;
+		quint64 nameOffset = get64(entry);
+		quint32 nameSize = get32(entry + 8);
+		if (nameOffset > fileSize || nameSize > fileSize - nameOffset) {
+			*error = "Truncated file";
+			return false;
+		}
+
+		QString name = QString::fromUtf8(reinterpret_cast<const char *>(data + nameOffset), int(nameSize));
+		if (!findSyncPage(name))
+			createSyncPage(name);
+	}
+
+	for (quint32 i = 0; i < trackCount; ++i) {
+		const uchar *entry = data + trackTable + i * TRACK_ENTRY_SIZE;
+		quint64 nameOffset = get64(entry);
+		quint32 nameSize = get32(entry + 8);
+		quint32 keyCount = get32(entry + 12);
+		quint64 keyOffset = get64(entry + 16);
+		quint32 keyCapacity = get32(entry + 24);
+		if (nameOffset > fileSize || nameSize > fileSize - nameOffset ||
+		    keyCount > keyCapacity || keyOffset > fileSize ||
+		    quint64(keyCapacity) * KEY_SIZE > fileSize - keyOffset) {
+			*error = "Truncated file";
+			return false;
+		}
+
+		QString name = QString::fromUtf8(reinterpret_cast<const char *>(data + nameOffset), int(nameSize));
+		if (findTrack(name)) {
+			*error = QString("Duplicate track \"%1\"").arg(name);
+			return false;
+		}
+
+		QVector<SyncTrack::TrackKey> keys;
+		if (!decodeKeys(data + keyOffset, keyCount, &keys)) {
+			*error = QString("Invalid keys in track \"%1\"").arg(name);
+			return false;
+		}
+
+		SyncTrack *t = createTrack(name);
+		t->loadKeys(keys);
+
+		binaryLayout.tracks.append(t);
+		binaryLayout.keyOffsets.append(keyOffset);
+		binaryLayout.keyCapacities.append(keyCapacity);
+	}
+
+	int prevRow = -1;
+	for (quint32 i = 0; i < bookmarkCount; ++i) {
+		int row = int(get32(data + bookmarkOffset + i * 4));
+		if (row <= prevRow) {
+			*error = "Invalid bookmarks";
+			return false;
+		}
+		rowBookmarks.append(row);
+		prevRow = row;
+	}
+
+	setRows(rows);
+	binaryLayout.bookmarkOffset = bookmarkOffset;
+	binaryLayout.bookmarkCapacity = bookmarkCapacity;
+	dirtyTracks.clear();
+	return true;
+}
+
+bool SyncDocument::updateBinary()
+{
+	// only our own file, exactly as we left it
+	QFileInfo info(binaryLayout.fileName);
+	if (!info.exists() || info.size() != binaryLayout.size ||
+	    info.lastModified() != binaryLayout.lastModified)
+		return false;
+
+	if (getTracksInPageOrder() != binaryLayout.tracks ||
+	    quint32(rowBookmarks.size()) > binaryLayout.bookmarkCapacity)
+		return false;
+
+	QHash<const SyncTrack *, int> indices;
+	QSet<const SyncTrack *>::const_iterator it;
+	for (it = dirtyTracks.constBegin(); it != dirtyTracks.constEnd(); ++it) {
+		int index = binaryLayout.tracks.indexOf(*it);
+		if (index < 0 || quint32((*it)->getKeyCount()) > binaryLayout.keyCapacities[index])
+			return false;
+		indices.insert(*it, index);
+	}
+
+	QFile file(binaryLayout.fileName);
+	QByteArray header(HEADER_SIZE, '\0');
+	if (!file.open(QIODevice::ReadWrite) ||
+	    file.read(header.data(), HEADER_SIZE) != HEADER_SIZE)
+		return false;
+
+	QVector<FilePatch> patches;
+	QByteArray count(4, '\0');
+	QHash<const SyncTrack *, int>::const_iterator jt;
+	for (jt = indices.constBegin(); jt != indices.constEnd(); ++jt) {
+		const QVector<SyncTrack::TrackKey> &keys = jt.key()->getKeys();
+		put32(count, 0, quint32(keys.size()));
+		patches.append(FilePatch(qint64(binaryLayout.keyOffsets[jt.value()]),
+		                         encodeKeys(keys, quint32(keys.size()))));
+		patches.append(FilePatch(HEADER_SIZE + jt.value() * TRACK_ENTRY_SIZE + 12, count));
+	}
+
+	QByteArray bookmarks(rowBookmarks.size() * 4, '\0');
+	for (int i = 0; i < rowBookmarks.size(); ++i)
+		put32(bookmarks, i * 4, quint32(rowBookmarks[i]));
+	patches.append(FilePatch(qint64(binaryLayout.bookmarkOffset), bookmarks));
+
+	put32(header, 8, quint32(getRows()));
+	put32(header, 20, quint32(rowBookmarks.size()));
+	patches.append(FilePatch(0, header));
+
+	// none of it reaches the file before all of it is safe elsewhere
+	QByteArray data("RKTU");
+	data.resize(8);
+	put32(data, 4, quint32(patches.size()));
+	for (int i = 0; i < patches.size(); ++i) {
+		QByteArray entry(12, '\0');
+		put64(entry, 0, quint64(patches[i].first));
+		put32(entry, 8, quint32(patches[i].second.size()));
+		data += entry + patches[i].second;
+	}
+	QByteArray sum(2, '\0');
+	qToLittleEndian(qChecksum(data.constData(), uint(data.size())),
+	                reinterpret_cast<uchar *>(sum.data()));
+	data += sum;
+
+	QFile update(getUpdateFileName(binaryLayout.fileName));
+	if (!update.open(QIODevice::WriteOnly | QIODevice::Truncate) ||
+	    update.write(data) != data.size() || !syncFile(update)) {
+		update.close();
+		update.remove();
+		return false;
+	}
+	update.close();
+
+	// from here on, a crash is finished off by the next load
+	if (!writePatches(file, patches))
+		return false;
+	file.close();
+	if (file.error() != QFile::NoError)
+		return false;
+	update.remove();
+
+	info.refresh();
+	binaryLayout.lastModified = info.lastModified();
+	dirtyTracks.clear();
+	return true;
+}
+
+bool SyncDocument::saveBinary(const QString &fileName)
+{
+	// anything updateBinary() can't do in place falls back to a full write
+	if (fileName == binaryLayout.fileName && updateBinary()) {
+		undoStack.setClean();
+		return true;
+	}
+
+	QVector<const SyncTrack *> order = getTracksInPageOrder();
+
+	QByteArray head(HEADER_SIZE + order.size() * TRACK_ENTRY_SIZE +
+	                syncPages.size() * PAGE_ENTRY_SIZE, '\0');
+	QByteArray strings;
+
+	int pageTable = HEADER_SIZE + order.size() * TRACK_ENTRY_SIZE;
+	for (int i = 0; i < syncPages.size(); ++i) {
+		QByteArray name = syncPages[i]->getName().toUtf8();
+		int entry = pageTable + i * PAGE_ENTRY_SIZE;
+		put64(head, entry, quint64(head.size() + strings.size()));
+		put32(head, entry + 8, quint32(name.size()));
+		put32(head, entry + 12, quint32(syncPages[i]->getTrackCount()));
+		strings += name;
+	}
+
+	BinaryLayout layout;
+	layout.fileName = fileName;
+	layout.tracks = order;
+
+	quint64 offset = align16(head.size() + strings.size());
+	for (int i = 0; i < order.size(); ++i) {
+		QByteArray name = order[i]->getName().toUtf8();
+		quint32 capacity = slackCapacity(order[i]->getKeyCount());
+		int entry = HEADER_SIZE + i * TRACK_ENTRY_SIZE;
+		put64(head, entry, quint64(head.size() + strings.size()));
+		put32(head, entry + 8, quint32(name.size()));
+		put32(head, entry + 12, quint32(order[i]->getKeyCount()));
+		put64(head, entry + 16, offset);
+		put32(head, entry + 24, capacity);
+		strings += name;
+
+		layout.keyOffsets.append(offset);
+		layout.keyCapacities.append(capacity);
+		offset = align16(offset + quint64(capacity) * KEY_SIZE);
+	}
+
+	layout.bookmarkOffset = offset;
+	layout.bookmarkCapacity = slackCapacity(rowBookmarks.size());
+
+	memcpy(head.data(), "RKTB", 4);
+	put32(head, 4, BINARY_VERSION);
+	put32(head, 8, quint32(getRows()));
+	put32(head, 12, quint32(order.size()));
+	put32(head, 16, quint32(syncPages.size()));
+	put32(head, 20, quint32(rowBookmarks.size()));
+	put32(head, 24, layout.bookmarkCapacity);
+	put64(head, 32, layout.bookmarkOffset);
+
+	QByteArray bookmarks(int(layout.bookmarkCapacity * 4), '\0');
+	for (int i = 0; i < rowBookmarks.size(); ++i)
+		put32(bookmarks, i * 4, quint32(rowBookmarks[i]));
+
+	// an in-place save that failed half way is finished first; its
+	// update file would not fit what comes next
+	if (!finishUpdate(fileName)) {
+		QMessageBox::critical(NULL, "Error",
+		                      QString("%1: An interrupted save could not be completed").arg(fileName));
+		return false;
+	}
+
+#ifdef USE_QSAVEFILE
+	QSaveFile file(fileName);
+#else
+	QFile file(fileName);
+#endif
+
+	if (!file.open(QIODevice::WriteOnly)) {
+		QMessageBox::critical(NULL, "Error", file.errorString());
+		return false;
+	}
+
+	// one track at a time, padded out to where the layout puts it
+	bool ok = file.write(head) >= 0 && file.write(strings) >= 0;
+	for (int i = 0; ok && i < order.size(); ++i) {
+		ok = file.write(QByteArray(int(layout.keyOffsets[i] - file.pos()), '\0')) >= 0 &&
+		     file.write(encodeKeys(order[i]->getKeys(), layout.keyCapacities[i])) >= 0;
+	}
+	ok = ok && file.write(QByteArray(int(layout.bookmarkOffset - file.pos()), '\0')) >= 0 &&
+	     file.write(bookmarks) >= 0;
+
+#ifdef USE_QSAVEFILE
+	ok = ok && file.commit();
+#else
+	file.close();
+	ok = ok && file.error() == QFile::NoError;
+#endif
+
+	if (!ok) {
+		QMessageBox::critical(NULL, "Error", file.errorString());
+		return false;
+	}
+
+	QFileInfo info(fileName);
+	layout.size = info.size();
+	layout.lastModified = info.lastModified();
+	binaryLayout = layout;
+	dirtyTracks.clear();
+
+	undoStack.setClean();
+	return true;
+}
@@ -0,0 +1,565 @@
+#include "syncjournal.h"
+#include "syncdocument.h"
+
+#include <QDateTime>
+#include <QFileInfo>
+#include <QHash>
+#include <QtConcurrentRun>
+#include <QtEndian>
+
+#include <string.h>
+
+/*
+ * Journal layout, all little-endian: a header of magic "RKTJ", version,
+ * and the size and modification time (ms since the epoch) of the document
+ * file it applies to. Then records of a type byte, a varint payload size,
+ * the payload and its qChecksum().
+ *
+ * Keys are written as a varint row delta, an interpolation type byte and
+ * the value bits, or just 0xff in place of the type for a removed key.
+ */
+
+enum {
+	JOURNAL_VERSION = 1,
+	JOURNAL_HEADER_SIZE = 24,
+	KEY_REMOVED = 0xff
+};
+
+enum {
+	RECORD_KEYS = 1,      /* changed rows of a track */
+	RECORD_ROWS = 2,      /* new row count */
+	RECORD_BOOKMARK = 3,  /* bookmark toggled */
+	RECORD_TRACK = 4,     /* all keys of a track, when compacted */
+	RECORD_BOOKMARKS = 5  /* all bookmarks, when compacted */
+};
+
+static void putVarint(QByteArray &data, quint32 v)
+{
+	while (v >= 0x80) {
+		data.append(char(v | 0x80));
+		v >>= 7;
+	}
+	data.append(char(v));
+}
+
+static bool getVarint(const QByteArray &data, int &pos, quint32 *v)
+{
+	*v = 0;
+	for (int shift = 0; shift < 35; shift += 7) {
+		if (pos >= data.size())
+			return false;
+		uchar b = uchar(data.at(pos++));
+		if (shift == 28 && (b & 0xf0))
+			return false; // more than 32 bits
+		*v |= quint32(b & 0x7f) << shift;
+		if (!(b & 0x80))
+			return true;
+	}
+	return false;
+}
+
+static void putKey(QByteArray &data, int type, float value)
+{
+	data.append(char(type));
+	if (type == KEY_REMOVED)
+		return;
+
+	union {
+		float f;
+		quint32 i;
+	} v;
+	v.f = value;
+	uchar bits[4];
+	qToLittleEndian(v.i, bits);
+	data.append(reinterpret_cast<const char *>(bits), 4);
+}
+
+static bool getKey(const QByteArray &data, int &pos, int *type, float *value)
+{
+	if (pos >= data.size())
+		return false;
+	*type = uchar(data.at(pos++));
+	if (*type == KEY_REMOVED)
+		return true;
+	if (*type >= SyncTrack::TrackKey::KEY_TYPE_COUNT || pos + 4 > data.size())
+		return false;
+
+	union {
+		float f;
+		quint32 i;
+	} v;
+	v.i = qFromLittleEndian<quint32>(reinterpret_cast<const uchar *>(data.constData() + pos));
+	pos += 4;
+	*value = v.f;
+	return true;
+}
+
+static QByteArray frameRecord(int type, const QByteArray &payload)
+{
+	QByteArray record;
+	record.append(char(type));
+	putVarint(record, payload.size());
+	record += payload;
+
+	uchar sum[2];
+	qToLittleEndian(qChecksum(payload.constData(), payload.size()), sum);
+	record.append(reinterpret_cast<const char *>(sum), 2);
+	return record;
+}
+
+static QByteArray encodeTrack(const QString &name, const QVector<SyncTrack::TrackKey> &keys)
+{
+	QByteArray payload;
+	QByteArray utf8 = name.toUtf8();
+	putVarint(payload, utf8.size());
+	payload += utf8;
+
+	putVarint(payload, keys.size());
+	int prevRow = 0;
+	for (int i = 0; i < keys.size(); ++i) {
+		putVarint(payload, keys[i].row - prevRow);
+		putKey(payload, keys[i].type, keys[i].value);
+		prevRow = keys[i].row;
+	}
+	return frameRecord(RECORD_TRACK, payload);
+}
+
+static QByteArray makeHeader(const QString &documentName)
+{
+	QFileInfo info(documentName);
+	QByteArray header(JOURNAL_HEADER_SIZE, '\0');
+	uchar *p = reinterpret_cast<uchar *>(header.data());
+	memcpy(p, "RKTJ", 4);
+	qToLittleEndian(quint32(JOURNAL_VERSION), p + 4);
+	qToLittleEndian(quint64(info.size()), p + 8);
+	qToLittleEndian(quint64(info.lastModified().toMSecsSinceEpoch()), p + 16);
+	return header;
+}
+
+typedef QPair<QString, QVector<SyncTrack::TrackKey> > TrackSnapshot;
+
+static bool writeCompacted(const QString &fileName, const QByteArray &header,
+                           const QVector<TrackSnapshot> &tracks, int rows,
+                           const QList<int> &bookmarks)
+{
+	QByteArray data = header;
+	for (int i = 0; i < tracks.size(); ++i)
+		data += encodeTrack(tracks[i].first, tracks[i].second);
+
+	QByteArray payload;
+	putVarint(payload, rows);
+	data += frameRecord(RECORD_ROWS, payload);
+
+	payload.clear();
+	putVarint(payload, bookmarks.size());
+	for (int i = 0; i < bookmarks.size(); ++i)
+		putVarint(payload, bookmarks[i]);
+	data += frameRecord(RECORD_BOOKMARKS, payload);
+
+	QFile file(fileName);
+	if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+		return false;
+	return file.write(data) == data.size() && file.flush();
+}
+
+SyncJournal::SyncJournal(SyncDocument *doc, const QString &documentName) :
+    QObject(doc),
+    doc(doc),
+    documentName(documentName),
+    fileName(getFileName(documentName)),
+    active(false),
+    checkpointing(false),
+    compacting(false),
+    compactThreshold(1 << 20),
+    generation(0),
+    compactGeneration(0)
+{
+	// one write per event, however many records it made
+	flushTimer.setSingleShot(true);
+	flushTimer.setInterval(0);
+	connect(&flushTimer, SIGNAL(timeout()), this, SLOT(flush()));
+	connect(&compactWatcher, SIGNAL(finished()), this, SLOT(onCompacted()));
+}
+
+SyncJournal::~SyncJournal()
+{
+	flush();
+	waitForCompaction();
+}
+
+bool SyncJournal::isRecoverable(const QString &documentName)
+{
+	QString fileName = getFileName(documentName);
+	QFile file(QFile::exists(fileName) ? fileName : fileName + ".tmp");
+	if (!file.open(QIODevice::ReadOnly))
+		return false;
+
+	return file.size() > JOURNAL_HEADER_SIZE &&
+	       file.read(JOURNAL_HEADER_SIZE) == makeHeader(documentName);
+}
+
+bool SyncJournal::create()
+{
+	waitForCompaction();
+	flushTimer.stop();
+	buffer.clear();
+	touchedTracks.clear();
+	++generation;
+
+	// the file itself waits for the first record, so a document nobody
+	// edits leaves nothing behind; whatever was there is from before
+	file.close();
+	QFile::remove(fileName + ".tmp");
+	file.setFileName(fileName);
+	active = !file.exists() || file.remove();
+
+	header = makeHeader(documentName);
+	compactThreshold = 1 << 20;
+	return active;
+}
+
+bool SyncJournal::replay()
+{
+	// a compaction that died between removing the old file and renaming the new
+	if (!QFile::exists(fileName) && QFile::exists(fileName + ".tmp"))
+		QFile::rename(fileName + ".tmp", fileName);
+
+	QFile in(fileName);
+	if (!in.open(QIODevice::ReadOnly))
+		return false;
+	QByteArray data = in.readAll();
+	in.close();
+
+	header = makeHeader(documentName);
+	if (!data.startsWith(header))
+		return false;
+
+	// apply everything to scratch tracks first, and the result in one step
+	QHash<QString, SyncTrack *> scratch;
+	QList<int> bookmarks = doc->getRowBookmarks();
+	int rows = -1;
+
+	int pos = JOURNAL_HEADER_SIZE;
+	while (pos < data.size()) {
+		int type = uchar(data.at(pos));
+		int payloadPos = pos + 1;
+		quint32 size;
+		if (!getVarint(data, payloadPos, &size) || size > quint32(data.size() - payloadPos) ||
+		    int(size) + 2 > data.size() - payloadPos)
+			break; // torn write
+
+		QByteArray payload = data.mid(payloadPos, int(size));
+		quint16 sum = qFromLittleEndian<quint16>(reinterpret_cast<const uchar *>(data.constData() + payloadPos + size));
+		if (sum != qChecksum(payload.constData(), payload.size()))
+			break;
+
+		int p = 0;
+		bool ok = true;
+		if (type == RECORD_KEYS || type == RECORD_TRACK) {
+			quint32 nameSize, count;
+			ok = getVarint(payload, p, &nameSize) && nameSize <= quint32(payload.size() - p);
+			QString name = ok ? QString::fromUtf8(payload.constData() + p, int(nameSize)) : QString();
+			p += int(nameSize);
+			ok = ok && getVarint(payload, p, &count);
+
+			SyncTrack *t = ok ? scratch.value(name) : NULL;
+			if (ok && !t) {
+				t = new SyncTrack(name, name);
+				const SyncTrack *orig = doc->findTrack(name);
+				if (orig)
+					t->replaceKeys(0, INT_MAX, orig->getKeys());
+				scratch.insert(name, t);
+			}
+
+			QVector<SyncTrack::TrackKey> keys;
+			quint32 row = 0;
+			for (quint32 i = 0; ok && i < count; ++i) {
+				quint32 delta;
+				int keyType;
+				float value = 0.0f;
+				ok = getVarint(payload, p, &delta) && delta <= quint32(INT_MAX) - row &&
+				     getKey(payload, p, &keyType, &value);
+				if (!ok)
+					break;
+				if (type == RECORD_TRACK && keyType == KEY_REMOVED) {
+					ok = false;
+					break;
+				}
+				row += delta;
+
+				SyncTrack::TrackKey key;
+				key.row = int(row);
+				key.value = value;
+				key.type = SyncTrack::TrackKey::KeyType(keyType);
+				if (type == RECORD_TRACK)
+					keys.append(key);
+				else if (keyType != KEY_REMOVED)
+					t->setKey(key);
+				else if (t->isKeyFrame(key.row))
+					t->removeKey(key.row);
+			}
+
+			if (ok && type == RECORD_TRACK)
+				t->replaceKeys(0, INT_MAX, keys);
+		} else if (type == RECORD_ROWS) {
+			quint32 v;
+			ok = getVarint(payload, p, &v) && v <= quint32(INT_MAX);
+			if (ok)
+				rows = int(v);
+		} else if (type == RECORD_BOOKMARK) {
+			quint32 v;
+			ok = getVarint(payload, p, &v) && v <= quint32(INT_MAX);
+			if (ok) {
+				QList<int>::iterator it = qLowerBound(bookmarks.begin(), bookmarks.end(), int(v));
+				if (it == bookmarks.end() || *it != int(v))
+					bookmarks.insert(it, int(v));
+				else
+					bookmarks.erase(it);
+			}
+		} else if (type == RECORD_BOOKMARKS) {
+			quint32 count, v;
+			ok = getVarint(payload, p, &count);
+			QList<int> list;
+			for (quint32 i = 0; ok && i < count; ++i) {
+				ok = getVarint(payload, p, &v) && v <= quint32(INT_MAX);
+				list.append(int(v));
+			}
+			if (ok)
+				bookmarks = list;
+		}
+
+		if (!ok)
+			break;
+		pos = payloadPos + int(size) + 2;
+	}
+
+	if (!scratch.isEmpty()) {
+		doc->beginMacro("recover");
+		QHash<QString, SyncTrack *>::const_iterator it;
+		for (it = scratch.constBegin(); it != scratch.constEnd(); ++it) {
+			SyncTrack *t = doc->findTrack(it.key());
+			if (!t)
+				t = doc->createTrack(it.key());
+			doc->replaceKeys(t, 0, INT_MAX, it.value()->getKeys());
+			touchedTracks.insert(it.key());
+		}
+		doc->endMacro();
+		qDeleteAll(scratch);
+	}
+
+	if (rows >= 0)
+		doc->setRows(rows);
+
+	QList<int> oldBookmarks = doc->getRowBookmarks();
+	for (int i = 0; i < oldBookmarks.size(); ++i)
+		if (!bookmarks.contains(oldBookmarks[i]))
+			doc->toggleRowBookmark(oldBookmarks[i]);
+	for (int i = 0; i < bookmarks.size(); ++i)
+		if (!doc->isRowBookmark(bookmarks[i]))
+			doc->toggleRowBookmark(bookmarks[i]);
+
+	// carry on after the last good record
+	file.close();
+	file.setFileName(fileName);
+	if (!file.open(QIODevice::ReadWrite) || !file.resize(pos) || !file.seek(pos))
+		return false;
+	compactThreshold = qMax(qint64(1) << 20, 2 * file.size());
+	active = true;
+	return true;
+}
+
+void SyncJournal::remove()
+{
+	waitForCompaction();
+	flushTimer.stop();
+	buffer.clear();
+	touchedTracks.clear();
+	++generation;
+	active = false;
+
+	file.close();
+	QFile::remove(fileName);
+	QFile::remove(fileName + ".tmp");
+}
+
+void SyncJournal::append(int type, const QByteArray &payload)
+{
+	if (!active)
+		return;
+
+	QByteArray record = frameRecord(type, payload);
+	buffer += record;
+	if (checkpointing)
+		checkpoint += record;
+	if (compacting)
+		tail += record;
+	if (!flushTimer.isActive())
+		flushTimer.start();
+}
+
+void SyncJournal::appendKeys(const SyncTrack *track, const SyncTrack::KeyChanges &changes)
+{
+	QByteArray payload;
+	QByteArray name = track->getName().toUtf8();
+	putVarint(payload, name.size());
+	payload += name;
+
+	// the state after the change, so replaying doesn't need the old keys
+	putVarint(payload, changes.rows.size());
+	int prevRow = 0;
+	for (int i = 0; i < changes.rows.size(); ++i) {
+		int row = changes.rows[i];
+		putVarint(payload, row - prevRow);
+		prevRow = row;
+
+		const SyncTrack::TrackKey *key = track->getPrevKeyFrame(row);
+		if (key && key->row == row)
+			putKey(payload, key->type, key->value);
+		else
+			putKey(payload, KEY_REMOVED, 0.0f);
+	}
+
+	touchedTracks.insert(track->getName());
+	append(RECORD_KEYS, payload);
+}
+
+void SyncJournal::appendRows(int rows)
+{
+	QByteArray payload;
+	putVarint(payload, rows);
+	append(RECORD_ROWS, payload);
+}
+
+void SyncJournal::appendBookmark(int row)
+{
+	QByteArray payload;
+	putVarint(payload, row);
+	append(RECORD_BOOKMARK, payload);
+}
+
+void SyncJournal::beginCheckpoint()
+{
+	checkpointing = true;
+	checkpoint.clear();
+}
+
+void SyncJournal::endCheckpoint()
+{
+	checkpointing = false;
+	checkpoint.clear();
+}
+
+bool SyncJournal::rebase(const QString &documentName)
+{
+	QByteArray records = checkpoint;
+	QSet<QString> tracks = touchedTracks;
+	endCheckpoint();
+
+	if (getFileName(documentName) != fileName) {
+		remove();
+		this->documentName = documentName;
+		fileName = getFileName(documentName);
+	}
+
+	if (!create())
+		return false;
+
+	// a superset is fine, it only decides what compaction writes out
+	touchedTracks = tracks;
+	buffer = records;
+	if (!buffer.isEmpty())
+		flushTimer.start();
+	return true;
+}
+
+void SyncJournal::flush()
+{
+	if (buffer.isEmpty() || !active)
+		return;
+
+	if (!file.isOpen()) {
+		if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate) ||
+		    file.write(header) != header.size()) {
+			// nowhere to keep them, so no journal rather than a torn one
+			file.close();
+			file.remove();
+			active = false;
+			buffer.clear();
+			return;
+		}
+	}
+
+	file.write(buffer);
+	file.flush();
+	buffer.clear();
+
+	if (file.size() > compactThreshold && !compacting)
+		compact();
+}
+
+void SyncJournal::compact()
+{
+	// key vectors are implicitly shared, so the snapshot is cheap
+	QVector<TrackSnapshot> tracks;
+	QSet<QString>::const_iterator it;
+	for (it = touchedTracks.constBegin(); it != touchedTracks.constEnd(); ++it) {
+		const SyncTrack *t = doc->findTrack(*it);
+		if (t)
+			tracks.append(TrackSnapshot(*it, t->getKeys()));
+	}
+
+	compacting = true;
+	compactGeneration = generation;
+	tail.clear();
+	compactWatcher.setFuture(QtConcurrent::run(writeCompacted, fileName + ".tmp", header,
+	                                           tracks, doc->getRows(), doc->getRowBookmarks()));
+}
+
+void SyncJournal::waitForCompaction()
+{
+	if (!compacting)
+		return;
+
+	// the worker would write its file after we're done with ours, and a
+	// leftover .tmp reads as a journal to recover
+	compactWatcher.waitForFinished();
+	compacting = false;
+	tail.clear();
+	QFile::remove(fileName + ".tmp");
+}
+
+void SyncJournal::onCompacted()
+{
+	// given up on in waitForCompaction()
+	if (!compacting)
+		return;
+	compacting = false;
+	QString tmpName = fileName + ".tmp";
+	if (!compactWatcher.result() || compactGeneration != generation) {
+		if (compactGeneration == generation)
+			QFile::remove(tmpName);
+		tail.clear();
+		return;
+	}
+
+	// whatever came in meanwhile goes after the snapshot, flushed or not
+	QFile tmp(tmpName);
+	if (!tmp.open(QIODevice::WriteOnly | QIODevice::Append) || tmp.write(tail) != tail.size()) {
+		QFile::remove(tmpName);
+		tail.clear();
+		return;
+	}
+	tmp.close();
+	tail.clear();
+	buffer.clear();
+
+	// not atomic, but replay() also looks for the new file under its old name
+	file.close();
+	QFile::remove(fileName);
+	QFile::rename(tmpName, fileName);
+	file.setFileName(fileName);
+	if (file.open(QIODevice::WriteOnly | QIODevice::Append))
+		compactThreshold = qMax(qint64(1) << 20, 2 * file.size());
+	else
+		active = false; // starting over would lose the snapshot
+}
@@ -0,0 +1,84 @@
+#ifndef SYNCJOURNAL_H
+#define SYNCJOURNAL_H
+
+#include <QByteArray>
+#include <QFile>
+#include <QFutureWatcher>
+#include <QObject>
+#include <QSet>
+#include <QString>
+#include <QTimer>
+
+#include "synctrack.h"
+
+class SyncDocument;
+
+/*
+ * Append-only record of every change made to a document since it was
+ * last saved, kept next to it as "<document>.journal" from the first
+ * change on. The journal names the exact file it applies to, so it is
+ * only replayed on top of the version it was started against. Records are checksummed, and a torn
+ * write at the end only loses that last record.
+ */
+class SyncJournal : public QObject {
+	Q_OBJECT
+public:
+	SyncJournal(SyncDocument *doc, const QString &documentName);
+	~SyncJournal();
+
+	static QString getFileName(const QString &documentName)
+	{
+		return documentName + ".journal";
+	}
+
+	// a journal against the document as it is on disk now, with changes
+	static bool isRecoverable(const QString &documentName);
+
+	bool create();
+	bool replay();
+	void remove();
+
+	void appendKeys(const SyncTrack *track, const SyncTrack::KeyChanges &changes);
+	void appendRows(int rows);
+	void appendBookmark(int row);
+
+	/* a save of the document as it is now has started; the records from
+	 * here on are kept aside, to start the journal over against the saved
+	 * file with them once it's in place */
+	void beginCheckpoint();
+	void endCheckpoint();
+	bool rebase(const QString &documentName);
+
+private slots:
+	void flush();
+	void onCompacted();
+
+private:
+	void append(int type, const QByteArray &payload);
+	void compact();
+	void waitForCompaction();
+
+	SyncDocument *doc;
+	QString documentName, fileName;
+	QByteArray header;
+	QFile file; // opened by the first flush() after create()
+	bool active;
+	QByteArray buffer;
+	QTimer flushTimer;
+	bool checkpointing;
+	QByteArray checkpoint;
+
+	/* tracks with records, the only ones a compacted journal needs */
+	QSet<QString> touchedTracks;
+
+	/* records appended while compacting, for the end of the new file;
+	 * a create() or remove() meanwhile waits for the worker and throws
+	 * its file away */
+	QFutureWatcher<bool> compactWatcher;
+	bool compacting;
+	QByteArray tail;
+	qint64 compactThreshold;
+	int generation, compactGeneration;
+};
+
+#endif // !defined(SYNCJOURNAL_H)
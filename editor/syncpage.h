@@ -1,6 +1,7 @@
 #ifndef SYNCPAGE_H
 #define SYNCPAGE_H
 
+#include <QHash>
 #include <QObject>
 #include <QString>
 #include <QVector>
@@ -23,6 +24,11 @@ public:
 
 	void addTrack(SyncTrack *);
 
+	int getTrackIndex(const SyncTrack *track) const
+	{
+		return trackIndices.value(track, -1);
+	}
+
 	void swapTrackOrder(int t1, int t2);
 
 	SyncDocument *getDocument()
@@ -33,9 +39,7 @@ public:
 	const QString &getName() { return name; }
 
 public slots:
-	void onKeyFrameAdded(int);
-	void onKeyFrameChanged(int, const SyncTrack::TrackKey &);
-	void onKeyFrameRemoved(int, const SyncTrack::TrackKey &);
+	void onKeysChanged(const SyncTrack::KeyChanges &);
 
 private:
 	void invalidateTrack(const SyncTrack &track);
@@ -45,6 +49,7 @@ private:
 	SyncDocument *document;
 	QString name;
 	QVector<SyncTrack *> tracks;
+	QHash<const SyncTrack *, int> trackIndices;
 
 signals:
 	void trackHeaderChanged(int trackIndex);
@@ -2,13 +2,17 @@
 #define SYNCTRACK_H
 
 #include <QObject>
-#include <QMap>
+#include <QPair>
+#include <QVector>
+
+#include <algorithm>
+#include <limits.h>
 
 class SyncTrack : public QObject {
 	Q_OBJECT
 public:
 	SyncTrack(const QString &name, const QString &displayName) :
-	    name(name), displayName(displayName), active(false)
+	    name(name), displayName(displayName), active(false), segment(0), batchDepth(0)
 	{
 	}
 
@@ -31,59 +35,159 @@ public:
 		} type;
 	};
 
+	typedef QVector<TrackKey>::const_iterator const_iterator;
+
+	/* what changed since the last keysChanged(): the rows of the keys
+	 * that were set or removed, and the merged intervals of rows whose
+	 * values might differ; the last interval may run up to INT_MAX */
+	struct KeyChanges {
+		QVector<int> rows;
+		QVector<QPair<int, int> > intervals;
+	};
+
 	void setKey(const TrackKey &key)
 	{
-		if (isKeyFrame(key.row)) {
-			const TrackKey oldKey = keys[key.row];
-			keys[key.row] = key;
-			emit keyFrameChanged(key.row, oldKey);
+		int index = findSegment(key.row);
+		if (index >= 0 && keys.at(index).row == key.row) {
+			keys[index] = key;
 		} else {
-			keys[key.row] = key;
-			emit keyFrameAdded(key.row);
+			keys.insert(index + 1, key);
+			segment = ++index;
 		}
+		addChange(key.row, index - 1, index + 1);
 	}
 
 	void removeKey(int row)
 	{
-		Q_ASSERT(keys.find(row) != keys.end());
-		const TrackKey oldKey = keys[row];
-		keys.remove(row);
-		emit keyFrameRemoved(row, oldKey);
+		int index = findSegment(row);
+		Q_ASSERT(index >= 0 && keys.at(index).row == row);
+		keys.remove(index);
+		addChange(row, index - 1, index);
+	}
+
+	/* the keys in [start, stop] */
+	QVector<TrackKey> getKeys(int start, int stop) const
+	{
+		int first = findSegment(start - 1) + 1;
+		int last = findSegment(stop) + 1;
+		return keys.mid(first, last - first);
+	}
+
+	/* replace the keys in [start, stop] in one pass; newKeys must be
+	 * sorted and inside the range */
+	void replaceKeys(int start, int stop, const QVector<TrackKey> &newKeys)
+	{
+		int first = findSegment(start - 1) + 1;
+		int last = findSegment(stop) + 1;
+		if (first == last && newKeys.isEmpty())
+			return;
+
+		for (int i = first; i < last; ++i)
+			changes.rows.append(keys.at(i).row);
+		for (int i = 0; i < newKeys.size(); ++i) {
+			Q_ASSERT(newKeys.at(i).row >= start && newKeys.at(i).row <= stop);
+			Q_ASSERT(!i || newKeys.at(i - 1).row < newKeys.at(i).row);
+			changes.rows.append(newKeys.at(i).row);
+		}
+
+		if (last - first == newKeys.size()) {
+			for (int i = 0; i < newKeys.size(); ++i)
+				keys[first + i] = newKeys.at(i);
+		} else {
+			QVector<TrackKey> merged;
+			merged.reserve(keys.size() - (last - first) + newKeys.size());
+			for (int i = 0; i < first; ++i)
+				merged.append(keys.at(i));
+			merged += newKeys;
+			for (int i = last; i < keys.size(); ++i)
+				merged.append(keys.at(i));
+			keys = merged;
+		}
+
+		addInterval(first - 1, first + newKeys.size());
+	}
+
+	/* for building a track nobody watches yet, as when loading: takes
+	 * the keys in any order, the last of several on one row wins, and
+	 * doesn't report anything */
+	void loadKeys(const QVector<TrackKey> &newKeys)
+	{
+		keys = newKeys;
+		segment = 0;
+
+		bool sorted = true;
+		for (int i = 1; sorted && i < keys.size(); ++i)
+			sorted = keys.at(i - 1).row < keys.at(i).row;
+		if (sorted)
+			return;
+
+		std::stable_sort(keys.begin(), keys.end(), keyBeforeKey);
+		int count = 0;
+		for (int i = 0; i < keys.size(); ++i) {
+			if (count && keys.at(count - 1).row == keys.at(i).row)
+				keys[count - 1] = keys.at(i);
+			else
+				keys[count++] = keys.at(i);
+		}
+		keys.resize(count);
+	}
+
+	/* hold keysChanged() back until the outermost endBatch() */
+	void beginBatch()
+	{
+		++batchDepth;
+	}
+
+	void endBatch()
+	{
+		Q_ASSERT(batchDepth > 0);
+		if (!--batchDepth)
+			flushChanges();
 	}
 
 	bool isKeyFrame(int row) const
 	{
-		QMap<int, TrackKey>::const_iterator it = keys.lowerBound(row);
-		return it != keys.end() && it.key() == row;
+		int index = findSegment(row);
+		return index >= 0 && keys.at(index).row == row;
 	}
 
 	TrackKey getKeyFrame(int row) const
 	{
 		Q_ASSERT(isKeyFrame(row));
-		QMap<int, TrackKey>::const_iterator it = keys.lowerBound(row);
-		return it.value();
+		return keys.at(findSegment(row));
 	}
 
 	const TrackKey *getPrevKeyFrame(int row) const
 	{
-		QMap<int, TrackKey>::const_iterator it = keys.lowerBound(row);
-		if (it != keys.constBegin() && (it == keys.constEnd() || it.key() != row))
-			--it;
-
-		if (it == keys.constEnd() || it.key() > row)
-			return NULL;
-
-		return &it.value();
+		int index = findSegment(row);
+		return index >= 0 ? &keys.at(index) : NULL;
 	}
 
 	const TrackKey *getNextKeyFrame(int row) const
 	{
-		QMap<int, TrackKey>::const_iterator it = keys.lowerBound(row + 1);
+		int index = findSegment(row) + 1;
+		return index < keys.size() ? &keys.at(index) : NULL;
+	}
+
+	/* sorted by row; invalidated by any change to the track */
+	const_iterator begin() const { return keys.constBegin(); }
+	const_iterator end() const { return keys.constEnd(); }
+
+	const_iterator lowerBound(int row) const
+	{
+		return keys.constBegin() + findSegment(row - 1) + 1;
+	}
 
-		if (it == keys.constEnd() || it.key() < row)
-			return NULL;
+	int getKeyCount() const
+	{
+		return keys.size();
+	}
 
-		return &it.value();
+	/* implicitly shared, so a copy is a cheap snapshot that later
+	 * edits won't touch; safe to hand to another thread */
+	const QVector<TrackKey> &getKeys() const
+	{
+		return keys;
 	}
 
 	static void getPolynomial(float coeffs[4], const TrackKey *key)
@@ -124,18 +228,14 @@ public:
 		if (!keys.size())
 			return 0.0;
 
-		const TrackKey *prevKey = getPrevKeyFrame(row);
-		const TrackKey *nextKey = getNextKeyFrame(row);
-
-		Q_ASSERT(prevKey != NULL || nextKey != NULL);
-		Q_ASSERT(prevKey != nextKey);
+		int index = findSegment(row);
+		if (index < 0)
+			return keys.first().value;
+		if (index + 1 == keys.size())
+			return keys.last().value;
 
-		if (!prevKey)
-			return nextKey->value;
-		if (!nextKey)
-			return prevKey->value;
-		if (prevKey == nextKey)
-			return prevKey->value;
+		const TrackKey *prevKey = &keys.at(index);
+		const TrackKey *nextKey = &keys.at(index + 1);
 
 		float coeffs[4];
 		getPolynomial(coeffs, prevKey);
@@ -146,11 +246,6 @@ public:
 		return coeffs[0] + (coeffs[1] + (coeffs[2] + coeffs[3] * x) * x) * x * mag;
 	}
 
-	const QMap<int, TrackKey> getKeyMap() const
-	{
-		return keys;
-	}
-
 	bool isActive() const
 	{
 		return active;
@@ -165,14 +260,96 @@ public:
 	const QString &getDisplayName() const { return displayName; }
 
 private:
+	static bool keyBeforeKey(const TrackKey &a, const TrackKey &b)
+	{
+		return a.row < b.row;
+	}
+
+	/* index of the last key at or before row, or -1 */
+	int findSegment(int row) const
+	{
+		int count = keys.size();
+		if (!count || keys.first().row > row)
+			return -1;
+
+		// appending, as when loading
+		if (keys.last().row <= row)
+			return count - 1;
+
+		// playback and painting mostly ask for the same or the next segment
+		for (int i = segment; i < segment + 2 && i + 1 < count; ++i) {
+			if (i >= 0 && keys.at(i).row <= row && keys.at(i + 1).row > row) {
+				segment = i;
+				return i;
+			}
+		}
+
+		int lo = 0, hi = count - 1;
+		while (lo < hi) {
+			int mid = lo + (hi - lo + 1) / 2;
+			if (keys.at(mid).row <= row)
+				lo = mid;
+			else
+				hi = mid - 1;
+		}
+		segment = lo;
+		return lo;
+	}
+
+	void addChange(int row, int prevIndex, int nextIndex)
+	{
+		changes.rows.append(row);
+		addInterval(prevIndex, nextIndex);
+	}
+
+	/* the values from the key at prevIndex up to the one at nextIndex */
+	void addInterval(int prevIndex, int nextIndex)
+	{
+		int start = prevIndex >= 0 ? keys.at(prevIndex).row : 0;
+		int stop = nextIndex < keys.size() ? keys.at(nextIndex).row - 1 : INT_MAX;
+		changes.intervals.append(qMakePair(start, stop));
+		if (!batchDepth)
+			flushChanges();
+	}
+
+	void flushChanges()
+	{
+		if (changes.rows.isEmpty())
+			return;
+
+		std::sort(changes.rows.begin(), changes.rows.end());
+		changes.rows.erase(std::unique(changes.rows.begin(), changes.rows.end()),
+		                   changes.rows.end());
+
+		std::sort(changes.intervals.begin(), changes.intervals.end());
+		int merged = 0;
+		for (int i = 1; i < changes.intervals.size(); ++i) {
+			QPair<int, int> &last = changes.intervals[merged];
+			const QPair<int, int> &next = changes.intervals.at(i);
+			if (next.first - 1 <= last.second)
+				last.second = qMax(last.second, next.second);
+			else
+				changes.intervals[++merged] = next;
+		}
+		changes.intervals.resize(merged + 1);
+
+		// the receivers may well edit the track again
+		KeyChanges batch;
+		qSwap(batch, changes);
+		emit keysChanged(batch);
+	}
+
 	QString name, displayName;
 	bool active;
-	QMap<int, TrackKey> keys;
+	QVector<TrackKey> keys;
+	mutable int segment;
+	int batchDepth;
+	KeyChanges changes;
 
 signals:
-	void keyFrameAdded(int row);
-	void keyFrameChanged(int row, const SyncTrack::TrackKey &old);
-	void keyFrameRemoved(int row, const SyncTrack::TrackKey &old);
+	void keysChanged(const SyncTrack::KeyChanges &changes);
 };
 
+Q_DECLARE_TYPEINFO(SyncTrack::TrackKey, Q_PRIMITIVE_TYPE);
+
 #endif // !defined(SYNCTRACK_H)
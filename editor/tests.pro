@@ -1,7 +1,7 @@
-QT = core gui xml network testlib
+QT = core gui network testlib
 
 greaterThan(QT_MAJOR_VERSION, 4) {
-    QT += widgets
+    QT += widgets concurrent
 }
 
 TARGET = tst_untitledtest
@@ -10,10 +10,21 @@ CONFIG   -= app_bundle
 
 TEMPLATE = app
 
-HEADERS += syncdocument.h \
+# zlib, as bundled with Qt on Windows and from the system elsewhere
+win32: INCLUDEPATH += $$[QT_INSTALL_HEADERS]/QtZlib
+else: LIBS += -lz
+
+HEADERS += gzipdevice.h \
+           keyblock.h \
+           syncdocument.h \
+           syncjournal.h \
            syncpage.h \
            synctrack.h
 
 SOURCES += tst_syncdocument.cpp \
+           gzipdevice.cpp \
+           keyblock.cpp \
            syncdocument.cpp \
+           syncdocumentbinary.cpp \
+           syncjournal.cpp \
            syncpage.cpp
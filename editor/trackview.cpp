@@ -1,19 +1,28 @@
 #include "trackview.h"
 #include "syncdocument.h"
+#include "keyblock.h"
 #include <qdrawutil.h>
 #include <QApplication>
 #include <QByteArray>
 #include <QClipboard>
 #include <QDoubleValidator>
+#include <QFontDatabase>
 #include <QLineEdit>
 #include <QMouseEvent>
 #include <QMimeData>
+#include <QPainter>
 #include <QScrollBar>
 #include <QStylePainter>
+#include <QtConcurrentRun>
+
+#include <algorithm>
 
 TrackView::TrackView(SyncPage *page, QWidget *parent) :
     QAbstractScrollArea(parent),
     page(page),
+    rowHeight(0),
+    trackWidth(0),
+    tileSerial(0),
     windowRows(0),
     readOnly(false),
     dragging(false)
@@ -45,7 +54,7 @@ TrackView::TrackView(SyncPage *page, QWidget *parent) :
 
 	selectionStart = selectionEnd = QPoint(0, 0);
 
-	updateFont(fontMetrics());
+	updateFont();
 	updatePalette();
 
 	stepPen = QPen();
@@ -59,6 +68,15 @@ TrackView::TrackView(SyncPage *page, QWidget *parent) :
 	handCursor = QCursor(Qt::OpenHandCursor);
 	setMouseTracking(true);
 
+	noValueText.setText("  ---");
+	noValueText.setTextFormat(Qt::PlainText);
+
+	// enough for a few screens worth of columns, even on 4K
+	tiles.setMaxCost(64 << 20);
+
+	// text on a QImage off the GUI thread is not supported everywhere
+	asyncTiles = QFontDatabase::supportsThreadedFontRendering();
+
 	setupScrollBars();
 	QObject::connect(horizontalScrollBar(), SIGNAL(valueChanged(int)), this, SLOT(onHScroll(int)));
 	QObject::connect(verticalScrollBar(), SIGNAL(valueChanged(int)), this, SLOT(onVScroll(int)));
@@ -76,6 +94,16 @@ void TrackView::onTrackHeaderChanged(int trackIndex)
 
 void TrackView::onTrackDataChanged(int trackIndex, int start, int stop)
 {
+	// a key changes the interpolation of every row between its
+	// neighbours, and a stale tile would keep showing the old one
+	const SyncTrack *t = getTrack(trackIndex);
+	const SyncTrack::TrackKey *prevKey = t->getPrevKeyFrame(start - 1);
+	const SyncTrack::TrackKey *nextKey = t->getNextKeyFrame(stop);
+	start = prevKey ? qMin(start, prevKey->row) : 0;
+	stop = nextKey ? qMax(stop, nextKey->row - 1) : qMax(stop, getRows());
+
+	invalidateTiles(trackIndex, start, stop);
+
 	QRect rect(QPoint(getPhysicalX(trackIndex),         getPhysicalY(start)),
 	           QPoint(getPhysicalX(trackIndex + 1) - 1, getPhysicalY(stop + 1) - 1));
 	viewport()->update(rect);
@@ -91,10 +119,19 @@ void TrackView::updatePalette()
 
 	rowPen       = QPen(QBrush(palette().base().color().darker(100.0 / 0.7)), 1);
 	rowSelectPen = QPen(QBrush(palette().highlight().color().darker(100.0 / 0.7)), 1);
+
+	clearTiles();
 }
 
-void TrackView::updateFont(const QFontMetrics &fontMetrics)
+void TrackView::updateFont()
 {
+	// measured against the viewport, the device the text is painted on
+	QFontMetrics fontMetrics(viewport()->font(), viewport());
+
+	if (rowHeight != fontMetrics.lineSpacing() ||
+	    trackWidth != fontMetrics.width('0') * 16)
+		clearTiles();
+
 	rowHeight = fontMetrics.lineSpacing();
 	trackWidth = fontMetrics.width('0') * 16;
 
@@ -107,9 +144,9 @@ int TrackView::getLogicalX(int track) const
 	return track * trackWidth;
 }
 
-int TrackView::getLogicalY(int row) const
+qint64 TrackView::getLogicalY(int row) const
 {
-	return row * rowHeight;
+	return qint64(row) * rowHeight;
 }
 
 int TrackView::getPhysicalX(int track) const
@@ -119,19 +156,21 @@ int TrackView::getPhysicalX(int track) const
 
 int TrackView::getPhysicalY(int row) const
 {
-	return topMarginHeight + getLogicalY(row) - scrollPosY;
+	// rows far off-screen only ever bound rectangles
+	const qint64 limit = 1 << 24;
+	return int(qBound(-limit, topMarginHeight + getLogicalY(row) - scrollPosY, limit));
 }
 
-inline int divfloor(int a, int b)
+inline qint64 divfloor(qint64 a, qint64 b)
 {
 	if (a < 0)
-		return -abs(a) / b - 1;
+		return -qAbs(a) / b - 1;
 	return a / b;
 }
 
 int TrackView::getTrackFromLogicalX(int x) const
 {
-	return divfloor(x, trackWidth);
+	return int(divfloor(x, trackWidth));
 }
 
 int TrackView::getTrackFromPhysicalX(int x) const
@@ -139,9 +178,9 @@ int TrackView::getTrackFromPhysicalX(int x) const
 	return getTrackFromLogicalX(x - leftMarginWidth + scrollPosX);
 }
 
-int TrackView::getRowFromLogicalY(int y) const
+int TrackView::getRowFromLogicalY(qint64 y) const
 {
-	return divfloor(y, rowHeight);
+	return int(qBound(qint64(INT_MIN), divfloor(y, rowHeight), qint64(INT_MAX)));
 }
 
 int TrackView::getRowFromPhysicalY(int y) const
@@ -153,8 +192,6 @@ void TrackView::paintEvent(QPaintEvent *event)
 {
 	QStylePainter painter(this->viewport());
 
-	updateFont(painter.fontMetrics()); // HACK: the fontMetrics we get from QWidget is not scaled properly
-
 	paintTopMargin(painter, event->region());
 	paintLeftMargin(painter, event->region());
 	paintTracks(painter, event->region());
@@ -195,7 +232,16 @@ void TrackView::paintTopMargin(QStylePainter &painter, const QRegion &region)
 		else
 			painter.setPen(QColor(0, 0, 0));
 
-		painter.drawText(fillRect, t->getDisplayName());
+		const QStaticText &text = getHeaderText(t->getDisplayName());
+		if (text.size().width() > trackWidth) {
+			// long names stop at the edge of their own header
+			painter.save();
+			painter.setClipRect(fillRect, Qt::IntersectClip);
+			painter.drawStaticText(fillRect.topLeft(), text);
+			painter.restore();
+		} else {
+			painter.drawStaticText(fillRect.topLeft(), text);
+		}
 	}
 
 	// make sure that the top margin isn't overdrawn by the track-data
@@ -237,7 +283,7 @@ void TrackView::paintLeftMargin(QStylePainter &painter, const QRegion &region)
 		else if ((row % 4) == 0) painter.setPen(QColor(64, 64, 64));
 		else                     painter.setPen(QColor(128, 128, 128));
 
-		painter.drawText(leftMargin, QString("%1").arg(row, 5, 16, QChar('0')).toUpper() + "h");
+		painter.drawStaticText(leftMargin.topLeft(), getRowText(row));
 	}
 }
 
@@ -276,62 +322,292 @@ QPen TrackView::getInterpolationPen(SyncTrack::TrackKey::KeyType type)
 	}
 }
 
-void TrackView::paintTrack(QStylePainter &painter, const QRegion &region, int track)
+const QStaticText &TrackView::getValueText(float value)
 {
-	const QRect &rect = region.boundingRect();
-	int firstRow = qBound(0, getRowFromPhysicalY(qMax(rect.top(), topMarginHeight)), getRows() - 1);
-	int lastRow = qBound(0, getRowFromPhysicalY(qMax(rect.bottom(), topMarginHeight)), getRows() - 1);
-
-	QRect selection = getSelection();
+	union {
+		float f;
+		quint32 i;
+	} v;
+	v.f = value;
+
+	QHash<quint32, QStaticText>::const_iterator it = valueTexts.constFind(v.i);
+	if (it != valueTexts.constEnd())
+		return *it;
+
+	// documents rarely use more distinct values than this on screen
+	if (valueTexts.size() >= 4096)
+		valueTexts.clear();
+
+	QStaticText text(QString::number(value, 'f', 2));
+	text.setTextFormat(Qt::PlainText);
+	text.setPerformanceHint(QStaticText::AggressiveCaching);
+	return *valueTexts.insert(v.i, text);
+}
 
-	const SyncTrack *t = getTrack(track);
+const QStaticText &TrackView::getRowText(int row)
+{
+	QHash<int, QStaticText>::const_iterator it = rowTexts.constFind(row);
+	if (it != rowTexts.constEnd())
+		return *it;
+
+	// a few screens worth, so scrolling back and forth stays cached
+	if (rowTexts.size() >= 4096)
+		rowTexts.clear();
+
+	QStaticText text(QString("%1").arg(row, 5, 16, QChar('0')).toUpper() + "h");
+	text.setTextFormat(Qt::PlainText);
+	text.setPerformanceHint(QStaticText::AggressiveCaching);
+	return *rowTexts.insert(row, text);
+}
 
-	for (int row = firstRow; row <= lastRow; ++row) {
-		QRect patternDataRect(getPhysicalX(track), getPhysicalY(row), trackWidth, rowHeight);
-		if (!region.intersects(patternDataRect))
-			continue;
+const QStaticText &TrackView::getHeaderText(const QString &name)
+{
+	QHash<QString, QStaticText>::const_iterator it = headerTexts.constFind(name);
+	if (it != headerTexts.constEnd())
+		return *it;
+
+	QStaticText text(name);
+	text.setTextFormat(Qt::PlainText);
+	text.setPerformanceHint(QStaticText::AggressiveCaching);
+	return *headerTexts.insert(name, text);
+}
 
-		const SyncTrack::TrackKey *key = t->getPrevKeyFrame(row);
+TrackView::CellStyle TrackView::getCellStyle(bool selected)
+{
+	CellStyle style;
+	style.font = viewport()->font();
+	style.rowHeight = rowHeight;
+	style.trackWidth = trackWidth;
+	style.baseBrush = selected ? selectBaseBrush : bgBaseBrush;
+	style.darkBrush = selected ? selectDarkBrush : bgDarkBrush;
+	style.rowPen = selected ? rowSelectPen : rowPen;
+	style.textPen = palette().color(selected ? QPalette::HighlightedText : QPalette::WindowText);
+	for (int i = 0; i < SyncTrack::TrackKey::KEY_TYPE_COUNT; ++i)
+		style.interpolationPens[i] = getInterpolationPen(SyncTrack::TrackKey::KeyType(i));
+	return style;
+}
 
-		SyncTrack::TrackKey::KeyType interpolationType = key ? key->type : SyncTrack::TrackKey::STEP;
-		bool selected = selection.contains(track, row);
+static bool keyBeforeRow(const SyncTrack::TrackKey &key, int row)
+{
+	return key.row < row;
+}
 
-		QBrush baseBrush = bgBaseBrush;
-		QBrush darkBrush = bgDarkBrush;
+void TrackView::paintCells(QPainter &painter, const CellStyle &style,
+                           const QVector<SyncTrack::TrackKey> &keys,
+                           int firstRow, int lastRow, const QPoint &origin,
+                           TrackView *textCache)
+{
+	// one search for the first row, then walk the keys along with the rows
+	QVector<SyncTrack::TrackKey>::const_iterator nextKey =
+	    std::lower_bound(keys.constBegin(), keys.constEnd(), firstRow, keyBeforeRow);
+	const SyncTrack::TrackKey *prevKey = nextKey != keys.constBegin() ? &*(nextKey - 1) : NULL;
 
-		if (selected) {
-			baseBrush = selectBaseBrush;
-			darkBrush = selectDarkBrush;
+	for (int row = firstRow; row <= lastRow; ++row) {
+		const SyncTrack::TrackKey *key = NULL;
+		if (nextKey != keys.constEnd() && nextKey->row == row) {
+			key = prevKey = &*nextKey;
+			++nextKey;
 		}
 
-		QBrush bgBrush = (row % 8 == 0) ? darkBrush : baseBrush;
+		QRect patternDataRect(origin.x(), origin.y() + (row - firstRow) * style.rowHeight,
+		                      style.trackWidth, style.rowHeight);
+
+		SyncTrack::TrackKey::KeyType interpolationType = prevKey ? prevKey->type : SyncTrack::TrackKey::STEP;
+
+		QBrush bgBrush = (row % 8 == 0) ? style.darkBrush : style.baseBrush;
 
 		QRect fillRect = patternDataRect;
 		painter.fillRect(fillRect, bgBrush);
 		if (row % 8 == 0) {
-			painter.setPen(selected ? rowSelectPen : rowPen);
+			painter.setPen(style.rowPen);
 			painter.drawLine(QPointF(patternDataRect.left() + 0.5, patternDataRect.top() + 0.5),
 			                 QPointF(patternDataRect.right() + 0.5, patternDataRect.top() + 0.5));
 		}
 
 		if (interpolationType != SyncTrack::TrackKey::STEP) {
-			painter.setPen(getInterpolationPen(interpolationType));
+			painter.setPen(style.interpolationPens[interpolationType]);
 			painter.drawLine(QPoint(patternDataRect.right(), patternDataRect.top() + 1),
 			                 QPoint(patternDataRect.right(), patternDataRect.bottom()));
 		}
 
-		if (row == editRow && track == editTrack) {
-			QRectF selectRect = QRectF(patternDataRect).adjusted(0.5, 0.5, -0.5, -0.5);
-			painter.setPen(QColor(0, 0, 0));
-			painter.drawRect(selectRect);
+		painter.setPen(style.textPen);
+		if (textCache) {
+			painter.drawStaticText(patternDataRect.topLeft(),
+			                       key ? textCache->getValueText(key->value) : textCache->noValueText);
+		} else {
+			// the static text cache belongs to the GUI thread
+			painter.drawText(patternDataRect, Qt::AlignLeft | Qt::AlignTop,
+			                 key ? QString::number(key->value, 'f', 2) : QString("  ---"));
+		}
+	}
+}
+
+QImage TrackView::renderTile(const CellStyle &style,
+                             const QVector<SyncTrack::TrackKey> &keys,
+                             int firstRow, int lastRow, int dpr)
+{
+	QImage image(QSize(style.trackWidth, (lastRow - firstRow + 1) * style.rowHeight) * dpr,
+	             QImage::Format_ARGB32_Premultiplied);
+	image.setDevicePixelRatio(dpr);
+
+	QPainter painter(&image);
+	painter.setFont(style.font);
+	paintCells(painter, style, keys, firstRow, lastRow, QPoint(0, 0), NULL);
+	return image;
+}
+
+static int tileCost(const QImage *tile)
+{
+#if QT_VERSION >= QT_VERSION_CHECK(5, 10, 0)
+	return int(tile->sizeInBytes());
+#else
+	return tile->byteCount();
+#endif
+}
+
+const QImage *TrackView::getTile(int track, int block)
+{
+	QPair<int, int> tileKey(track, block);
+	QImage *tile = tiles.object(tileKey);
+	if (!tile)
+		staleTiles.remove(tileKey); // evicted meanwhile
+	else if (!staleTiles.contains(tileKey))
+		return tile;
+	if (pendingTiles.contains(tileKey))
+		return tile;
+
+	int firstRow = block * TILE_ROWS;
+	int lastRow = qMin(firstRow + TILE_ROWS, getRows()) - 1;
+	int dpr = viewport()->devicePixelRatio();
+	CellStyle style = getCellStyle(false);
+	QVector<SyncTrack::TrackKey> keys = getTrack(track)->getKeys();
+
+	if (asyncTiles) {
+		// render from a snapshot of the keys, and show up when done
+		QFutureWatcher<QImage> *watcher = new QFutureWatcher<QImage>(this);
+		TileRequest request = { tileKey, ++tileSerial };
+		pendingTiles.insert(tileKey, request.serial);
+		tileWatchers.insert(watcher, request);
+		connect(watcher, SIGNAL(finished()), this, SLOT(onTileRendered()));
+		watcher->setFuture(QtConcurrent::run(&TrackView::renderTile, style, keys,
+		                                     firstRow, lastRow, dpr));
+		return tile;
+	}
+
+	staleTiles.remove(tileKey);
+	tile = new QImage(renderTile(style, keys, firstRow, lastRow, dpr));
+	int cost = tileCost(tile);
+	if (!tiles.insert(tileKey, tile, cost))
+		return NULL; // too big to keep, and already deleted
+	return tile;
+}
+
+void TrackView::onTileRendered()
+{
+	QFutureWatcher<QImage> *watcher = static_cast<QFutureWatcher<QImage> *>(sender());
+	TileRequest request = tileWatchers.take(watcher);
+	watcher->deleteLater();
+
+	// the keys or the layout changed while this one was in flight
+	if (watcher->isCanceled() || pendingTiles.value(request.tile, -1) != request.serial)
+		return;
+	pendingTiles.remove(request.tile);
+	staleTiles.remove(request.tile);
+
+	QImage *tile = new QImage(watcher->result());
+	int cost = tileCost(tile);
+	tiles.insert(request.tile, tile, cost);
+
+	int track = request.tile.first;
+	int firstRow = request.tile.second * TILE_ROWS;
+	QRect rect(QPoint(getPhysicalX(track), getPhysicalY(firstRow)),
+	           QPoint(getPhysicalX(track + 1) - 1, getPhysicalY(firstRow + TILE_ROWS) - 1));
+	viewport()->update(rect);
+}
+
+void TrackView::invalidateTiles(int track, int start, int stop)
+{
+	int first = start / TILE_ROWS, last = stop / TILE_ROWS;
+	if (last - first < tiles.size() + pendingTiles.size()) {
+		for (int block = first; block <= last; ++block) {
+			QPair<int, int> tileKey(track, block);
+			if (tiles.contains(tileKey))
+				staleTiles.insert(tileKey);
+			pendingTiles.remove(tileKey);
 		}
+		return;
+	}
 
-		painter.setPen(selected ?
-		    palette().color(QPalette::HighlightedText) :
-		    palette().color(QPalette::WindowText));
-		painter.drawText(patternDataRect, t->isKeyFrame(row) ?
-		                 QString::number(t->getKeyFrame(row).value, 'f', 2) :
-		                 "  ---");
+	// a long document costs no more than the tiles there are
+	QList<QPair<int, int> > keys = tiles.keys();
+	for (int i = 0; i < keys.size(); ++i)
+		if (keys[i].first == track && keys[i].second >= first && keys[i].second <= last)
+			staleTiles.insert(keys[i]);
+
+	QHash<QPair<int, int>, int>::iterator it = pendingTiles.begin();
+	while (it != pendingTiles.end()) {
+		if (it.key().first == track && it.key().second >= first && it.key().second <= last)
+			it = pendingTiles.erase(it);
+		else
+			++it;
+	}
+}
+
+void TrackView::clearTiles()
+{
+	tiles.clear();
+	staleTiles.clear();
+	pendingTiles.clear();
+
+	// drop what hasn't started yet; the rest finishes and is ignored
+	QHash<QFutureWatcher<QImage> *, TileRequest>::const_iterator it;
+	for (it = tileWatchers.constBegin(); it != tileWatchers.constEnd(); ++it)
+		it.key()->cancel();
+}
+
+void TrackView::paintTrack(QStylePainter &painter, const QRegion &region, int track)
+{
+	const QRect &rect = region.boundingRect();
+	int firstRow = qBound(0, getRowFromPhysicalY(qMax(rect.top(), topMarginHeight)), getRows() - 1);
+	int lastRow = qBound(0, getRowFromPhysicalY(qMax(rect.bottom(), topMarginHeight)), getRows() - 1);
+
+	const SyncTrack *t = getTrack(track);
+	int x = getPhysicalX(track);
+
+	// the cells themselves come from the tile cache...
+	for (int block = firstRow / TILE_ROWS; block <= lastRow / TILE_ROWS; ++block) {
+		int blockRow = block * TILE_ROWS;
+		int blockRows = qMin(TILE_ROWS, getRows() - blockRow);
+		QRect tileRect(x, getPhysicalY(blockRow), trackWidth, blockRows * rowHeight);
+		if (!region.intersects(tileRect))
+			continue;
+
+		// a stale tile is only shown until its replacement is done
+		const QImage *tile = getTile(track, block);
+		if (tile)
+			painter.drawImage(tileRect.topLeft(), *tile);
+		else if (pendingTiles.contains(QPair<int, int>(track, block)))
+			painter.fillRect(tileRect, bgBaseBrush); // still being rendered
+		else
+			paintCells(painter, getCellStyle(false), t->getKeys(),
+			           blockRow, blockRow + blockRows - 1, tileRect.topLeft(), this);
+	}
+
+	// ...while selection and cursor are drawn on top
+	QRect selection = getSelection();
+	if (track >= selection.left() && track <= selection.right()) {
+		int first = qMax(firstRow, selection.top());
+		int last = qMin(lastRow, selection.bottom());
+		if (first <= last)
+			paintCells(painter, getCellStyle(true), t->getKeys(),
+			           first, last, QPoint(x, getPhysicalY(first)), this);
+	}
+
+	if (track == editTrack && editRow >= firstRow && editRow <= lastRow) {
+		QRect patternDataRect(x, getPhysicalY(editRow), trackWidth, rowHeight);
+		QRectF selectRect = QRectF(patternDataRect).adjusted(0.5, 0.5, -0.5, -0.5);
+		painter.setPen(QColor(0, 0, 0));
+		painter.drawRect(selectRect);
 	}
 }
 
@@ -384,11 +660,7 @@ void TrackView::mouseReleaseEvent(QMouseEvent *event)
 	}
 }
 
-struct CopyEntry
-{
-	int track;
-	SyncTrack::TrackKey keyFrame;
-};
+static const char *keysMimeType = "application/x-gnu-rocket-keys";
 
 void TrackView::editCopy()
 {
@@ -399,33 +671,12 @@ void TrackView::editCopy()
 
 	QRect selection = getSelection();
 
-	QVector<struct CopyEntry> copyEntries;
-	for (int track = selection.left(); track <= selection.right(); ++track) {
-		const SyncTrack *t = getTrack(track);
-
-		for (int row = selection.top(); row <= selection.bottom(); ++row) {
-			if (t->isKeyFrame(row)) {
-				CopyEntry ce;
-				ce.track = track - selection.left();
-				ce.keyFrame = t->getKeyFrame(row);
-				ce.keyFrame.row -= selection.top();
-				copyEntries.push_back(ce);
-			}
-		}
-	}
-
-	int buffer_width  = selection.width();
-	int buffer_height = selection.height();
-	size_t buffer_size = copyEntries.size();
-
-	QByteArray data;
-	data.append((char *)&buffer_width, sizeof(int));
-	data.append((char *)&buffer_height, sizeof(int));
-	data.append((char *)&buffer_size, sizeof(size_t));
-	data.append((char *)copyEntries.data(), sizeof(CopyEntry) * copyEntries.size());
+	QVector<QVector<SyncTrack::TrackKey> > columns;
+	for (int track = selection.left(); track <= selection.right(); ++track)
+		columns.append(getTrack(track)->getKeys(selection.top(), selection.bottom()));
 
 	QMimeData *mimeData = new QMimeData;
-	mimeData->setData("application/x-gnu-rocket", data);
+	mimeData->setData(keysMimeType, encodeKeyBlock(columns, selection.top(), selection.height()));
 	QApplication::clipboard()->setMimeData(mimeData);
 }
 
@@ -450,59 +701,35 @@ void TrackView::editPaste()
 	}
 
 	const QMimeData *mimeData = QApplication::clipboard()->mimeData();
-	if (mimeData->hasFormat("application/x-gnu-rocket")) {
-		const QByteArray mimeDataBuffer = mimeData->data("application/x-gnu-rocket");
-		const char *clipbuf = mimeDataBuffer.data();
-
-		// copy data
-		int buffer_width, buffer_height, buffer_size;
-		memcpy(&buffer_width,  clipbuf + 0,               sizeof(int));
-		memcpy(&buffer_height, clipbuf + sizeof(int),     sizeof(int));
-		memcpy(&buffer_size,   clipbuf + 2 * sizeof(int), sizeof(int));
-
-		doc->beginMacro("paste");
-
-		const char *src = clipbuf + 2 * sizeof(int) + sizeof(size_t);
-		QMap<QPair<int, int>, CopyEntry> copyEntries;
-		for (int i = 0; i < buffer_size; ++i) {
-			struct CopyEntry ce;
-			memcpy(&ce, src, sizeof(CopyEntry));
-			src += sizeof(CopyEntry);
-
-			Q_ASSERT(ce.track >= 0);
-			Q_ASSERT(ce.track < buffer_width);
-			Q_ASSERT(ce.keyFrame.row >= 0);
-			Q_ASSERT(ce.keyFrame.row < buffer_height);
-
-			copyEntries.insert(QPair<int, int>(editTrack + ce.track, editRow + ce.keyFrame.row), ce);
-		}
-
-		for (int i = 0; i < buffer_width; ++i) {
-			int trackPos = editTrack + i;
-			if (trackPos >= getTrackCount())
-				continue;
-
-			SyncTrack *t = getTrack(trackPos);
-			for (int j = 0; j < buffer_height; ++j) {
-				int row = editRow + j;
-
-				QMap<QPair<int, int>, CopyEntry>::const_iterator copyEntry =
-				    copyEntries.constFind(QPair<int, int>(trackPos, row));
-				if (copyEntry != copyEntries.constEnd()) {
-					SyncTrack::TrackKey key = copyEntry->keyFrame;
-					key.row += editRow;
-					doc->setKeyFrame(t, key);
-				} else if (t->isKeyFrame(row))
-					doc->deleteKeyFrame(t, row);
-			}
-		}
-		doc->endMacro();
+	QVector<QVector<SyncTrack::TrackKey> > columns;
+	int height;
+	if (!mimeData->hasFormat(keysMimeType) ||
+	    !decodeKeyBlock(mimeData->data(keysMimeType), doc->getRows(), &columns, &height)) {
+		QApplication::beep();
+		return;
+	}
 
-		dirtyCurrentValue();
+	// the block is no taller than the document, but the rows it lands on
+	// may still run past the last int
+	height = int(qMin(qint64(height), qint64(INT_MAX) - editRow + 1));
+
+	doc->beginMacro("paste");
+	for (int i = 0; i < columns.size(); ++i) {
+		int trackPos = editTrack + i;
+		if (trackPos >= getTrackCount())
+			break;
+
+		// already sorted, so the block merges into the track in one pass
+		QVector<SyncTrack::TrackKey> keys = columns[i];
+		int count = 0;
+		while (count < keys.size() && keys[count].row < height)
+			keys[count++].row += editRow;
+		keys.resize(count);
+		doc->replaceKeys(getTrack(trackPos), editRow, editRow + height - 1, keys);
+	}
+	doc->endMacro();
 
-		clipbuf = NULL;
-	} else
-		QApplication::beep();
+	dirtyCurrentValue();
 }
 
 void TrackView::editUndo()
@@ -615,14 +842,17 @@ void TrackView::scrollWindow(int scrollX, int scrollY)
 	viewport()->scroll(scrollX, scrollY, clip);
 }
 
-void TrackView::setScrollPos(int newScrollPosX, int newScrollPosY)
+void TrackView::setScrollPos(int newScrollPosX, qint64 newScrollPosY)
 {
 	// clamp newscrollPosX
 	newScrollPosX = qMax(newScrollPosX, 0);
 
 	if (newScrollPosX != scrollPosX || newScrollPosY != scrollPosY) {
 		int deltaX = scrollPosX - newScrollPosX;
-		int deltaY = scrollPosY - newScrollPosY;
+
+		// a jump further than the viewport is tall just repaints it all
+		qint64 height = viewport()->height();
+		int deltaY = int(qBound(-height, scrollPosY - newScrollPosY, height));
 
 		// update scrollPos
 		scrollPosX = newScrollPosX;
@@ -653,7 +883,7 @@ bool TrackView::internalSetEditRow(int newEditRow, bool selecting)
 		invalidateLeftMarginRow(editRow);
 	}
 
-	setScrollPos(scrollPosX, (editRow * rowHeight) - ((viewport()->height() - topMarginHeight) / 2) + rowHeight / 2);
+	setScrollPos(scrollPosX, getLogicalY(editRow) - ((viewport()->height() - topMarginHeight) / 2) + rowHeight / 2);
 	return change;
 }
 
@@ -690,6 +920,7 @@ void TrackView::setEditTrack(int newEditTrack, bool selecting)
 
 void TrackView::setRows(int rows)
 {
+	clearTiles();
 	viewport()->update();
 	setEditRow(qMin(editRow, rows - 1), false);
 	setupScrollBars();
@@ -764,19 +995,14 @@ void TrackView::editToggleInterpolationType()
 
 	if (editTrack < getTrackCount()) {
 		SyncTrack *t = getTrack(editTrack);
-		QMap<int, SyncTrack::TrackKey> keyMap = t->getKeyMap();
-
-		QMap<int, SyncTrack::TrackKey>::const_iterator it = keyMap.lowerBound(editRow);
-		if (it != keyMap.constBegin() && it.key() != editRow)
-			--it;
-
-		if (it.key() > editRow || it == keyMap.constEnd()) {
+		const SyncTrack::TrackKey *key = t->getPrevKeyFrame(editRow);
+		if (!key) {
 			QApplication::beep();
 			return;
 		}
 
 		// copy and modify
-		SyncTrack::TrackKey newKey = *it;
+		SyncTrack::TrackKey newKey = *key;
 		newKey.type = (SyncTrack::TrackKey::KeyType)
 		    ((newKey.type + 1) % SyncTrack::TrackKey::KEY_TYPE_COUNT);
 
@@ -801,11 +1027,8 @@ void TrackView::editClear()
 	doc->beginMacro("clear");
 	for (int track = selection.left(); track <= selection.right(); ++track) {
 		SyncTrack *t = getTrack(track);
-
-		for (int row = selection.top(); row <= selection.bottom(); ++row) {
-			if (t->isKeyFrame(row))
-				doc->deleteKeyFrame(t, row);
-		}
+		doc->replaceKeys(t, selection.top(), selection.bottom(),
+		                 QVector<SyncTrack::TrackKey>());
 	}
 
 	doc->endMacro();
@@ -828,15 +1051,13 @@ void TrackView::editBiasValue(float amount)
 		Q_ASSERT(track < getTrackCount());
 		SyncTrack *t = getTrack(track);
 
-		for (int row = selection.top(); row <= selection.bottom(); ++row) {
-			if (t->isKeyFrame(row)) {
-				SyncTrack::TrackKey k = t->getKeyFrame(row); // copy old key
-				k.value += amount; // modify value
+		QVector<SyncTrack::TrackKey> keys = t->getKeys(selection.top(), selection.bottom());
+		for (int i = 0; i < keys.size(); ++i)
+			keys[i].value += amount;
 
-				// add sub-command
-				doc->setKeyFrame(t, k);
-			}
-		}
+		// one sub-command for the whole column
+		if (!keys.isEmpty())
+			doc->replaceKeys(t, selection.top(), selection.bottom(), keys);
 	}
 	doc->endMacro();
 
@@ -1022,11 +1243,23 @@ void TrackView::resizeEvent(QResizeEvent *event)
 	setupScrollBars();
 }
 
+void TrackView::showEvent(QShowEvent *event)
+{
+	QAbstractScrollArea::showEvent(event);
+
+	// the screen, and with it the font scaling, is only known once shown
+	updateFont();
+}
+
 void TrackView::changeEvent(QEvent *event)
 {
 	switch (event->type()) {
 	case QEvent::FontChange:
-		updateFont(fontMetrics());
+		updateFont();
+		valueTexts.clear();
+		rowTexts.clear();
+		headerTexts.clear();
+		clearTiles();
 		update();
 		break;
 
@@ -2,15 +2,23 @@
 #define TRACKVIEW_H
 
 #include <QAbstractScrollArea>
+#include <QCache>
+#include <QFutureWatcher>
+#include <QHash>
+#include <QImage>
 #include <QKeyEvent>
 #include <QPaintEvent>
+#include <QPair>
 #include <QPen>
+#include <QSet>
+#include <QStaticText>
 
 #include "synctrack.h"
 #include "syncpage.h"
 
 class QFontMetrics;
 class QLineEdit;
+class QPainter;
 class QStylePainter;
 class SyncDocument;
 class SyncPage;
@@ -72,6 +80,7 @@ private slots:
 	void onEditingFinished();
 	void onTrackHeaderChanged(int trackIndex);
 	void onTrackDataChanged(int trackIndex, int start, int stop);
+	void onTileRendered();
 
 public slots:
 	void editUndo();
@@ -105,16 +114,41 @@ private:
 	void paintTracks(QStylePainter &painter, const QRegion &region);
 	void paintTrack(QStylePainter &painter, const QRegion &region, int track);
 
+	/* everything needed to paint cells, without touching the widget */
+	struct CellStyle {
+		QFont font;
+		int rowHeight, trackWidth;
+		QBrush baseBrush, darkBrush;
+		QPen rowPen, textPen;
+		QPen interpolationPens[SyncTrack::TrackKey::KEY_TYPE_COUNT];
+	};
+	CellStyle getCellStyle(bool selected);
+
+	static void paintCells(QPainter &painter, const CellStyle &style,
+	                       const QVector<SyncTrack::TrackKey> &keys,
+	                       int firstRow, int lastRow, const QPoint &origin,
+	                       TrackView *textCache);
+	static QImage renderTile(const CellStyle &style,
+	                         const QVector<SyncTrack::TrackKey> &keys,
+	                         int firstRow, int lastRow, int dpr);
+	const QImage *getTile(int track, int block);
+	void invalidateTiles(int track, int start, int stop);
+	void clearTiles();
+	const QStaticText &getValueText(float value);
+	const QStaticText &getRowText(int row);
+	const QStaticText &getHeaderText(const QString &name);
+
 	void paintEvent(QPaintEvent *);
 	void keyPressEvent(QKeyEvent *);
 	void resizeEvent(QResizeEvent *);
 	void mouseMoveEvent(QMouseEvent *);
 	void mousePressEvent(QMouseEvent *);
 	void mouseReleaseEvent(QMouseEvent *);
+	void showEvent(QShowEvent *);
 	void changeEvent(QEvent *);
 
 	void setupScrollBars();
-	void setScrollPos(int newScrollPosX, int newScrollPosY);
+	void setScrollPos(int newScrollPosX, qint64 newScrollPosY);
 	void scrollWindow(int newScrollPosX, int newScrollPosY);
 
 	void invalidateLeftMarginRow(int row)
@@ -134,14 +168,16 @@ private:
 
 	QPen getInterpolationPen(SyncTrack::TrackKey::KeyType type);
 
+	/* logical Y is 64-bit, rows times row height easily outgrows an int;
+	 * physical Y is pinned to a range that always fits a QRect */
 	int getLogicalX(int track) const;
-	int getLogicalY(int row) const;
+	qint64 getLogicalY(int row) const;
 	int getPhysicalX(int track) const;
 	int getPhysicalY(int row) const;
 
 	int getTrackFromLogicalX(int x) const;
 	int getTrackFromPhysicalX(int x) const;
-	int getRowFromLogicalY(int y) const;
+	int getRowFromLogicalY(qint64 y) const;
 	int getRowFromPhysicalY(int y) const;
 
 	SyncPage *page;
@@ -153,7 +189,7 @@ private:
 	int trackWidth;
 	int topMarginHeight;
 	int leftMarginWidth;
-	void updateFont(const QFontMetrics &fontMetrics);
+	void updateFont();
 
 	QBrush bgBaseBrush, bgDarkBrush;
 	QBrush selectBaseBrush, selectDarkBrush;
@@ -163,10 +199,39 @@ private:
 	QCursor handCursor;
 	void updatePalette();
 
+	/* formatted key values, keyed by their bits */
+	QHash<quint32, QStaticText> valueTexts;
+	QStaticText noValueText;
+
+	/* row numbers for the left margin, and track names for the top */
+	QHash<int, QStaticText> rowTexts;
+	QHash<QString, QStaticText> headerTexts;
+
+	/* rendered cells of TILE_ROWS rows of a track, without selection
+	 * and cursor; keyed by track index and row block */
+	enum { TILE_ROWS = 64 };
+	QCache<QPair<int, int>, QImage> tiles;
+
+	/* cached tiles whose keys have changed since; they stand in for
+	 * their replacement until it has been rendered */
+	QSet<QPair<int, int> > staleTiles;
+
+	/* tiles being rendered on the thread pool, with the serial of the
+	 * job whose result is still wanted */
+	struct TileRequest {
+		QPair<int, int> tile;
+		int serial;
+	};
+	QHash<QPair<int, int>, int> pendingTiles;
+	QHash<QFutureWatcher<QImage> *, TileRequest> tileWatchers;
+	int tileSerial;
+	bool asyncTiles;
+
 	/* cursor position */
 	int editRow, editTrack;
 
-	int scrollPosX,  scrollPosY;
+	int scrollPosX;
+	qint64 scrollPosY;
 	int windowRows;
 
 	QLineEdit *lineEdit;
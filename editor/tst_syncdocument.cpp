@@ -1,6 +1,7 @@
 #include <QString>
 #include <QtTest>
 #include "syncdocument.h"
+#include "keyblock.h"
 
 class SyncDocumentTest : public QObject
 {
@@ -9,6 +10,20 @@ class SyncDocumentTest : public QObject
 private Q_SLOTS:
 	void prevRowBookmark();
 	void nextRowBookmark();
+	void findTrack();
+	void trackKeys();
+	void swapTrackOrder();
+	void batchedChanges();
+	void replaceKeys();
+	void keyBlock();
+	void loadKeys();
+	void undoMemoryLimit();
+	void saveLoad();
+	void backgroundSave();
+	void parallelLoad();
+	void compressedSaveLoad();
+	void binaryRoundTrip();
+	void journalRecovery();
 };
 
 void SyncDocumentTest::prevRowBookmark()
@@ -45,6 +60,610 @@ void SyncDocumentTest::nextRowBookmark()
 	QVERIFY(doc.nextRowBookmark(10) == 11);
 }
 
-QTEST_APPLESS_MAIN(SyncDocumentTest)
+void SyncDocumentTest::findTrack()
+{
+	SyncDocument doc;
+
+	QVERIFY(doc.findTrack("foo") == NULL);
+
+	SyncTrack *foo = doc.createTrack("foo");
+	SyncTrack *bar = doc.createTrack("page:bar");
+	QVERIFY(doc.findTrack("foo") == foo);
+	QVERIFY(doc.findTrack("page:bar") == bar);
+	QVERIFY(doc.findTrack("bar") == NULL);
+	QCOMPARE(doc.getTrackCount(), 2);
+}
+
+void SyncDocumentTest::trackKeys()
+{
+	SyncTrack track("t", "t");
+	QVERIFY(track.getPrevKeyFrame(0) == NULL);
+	QCOMPARE(track.getValue(5), 0.0);
+
+	SyncTrack::TrackKey k;
+	k.type = SyncTrack::TrackKey::LINEAR;
+	for (int row = 40; row >= 0; row -= 10) {
+		k.row = row;
+		k.value = float(row);
+		track.setKey(k);
+	}
+	QCOMPARE(track.getKeyCount(), 5);
+
+	// walk forward, then jump back, so both the cache and the search are used
+	for (int row = 0; row < 50; ++row)
+		QCOMPARE(float(track.getValue(row)), float(qMin(row, 40)));
+	QCOMPARE(track.getPrevKeyFrame(15)->row, 10);
+	QCOMPARE(track.getNextKeyFrame(15)->row, 20);
+	QCOMPARE(track.getNextKeyFrame(20)->row, 30);
+	QVERIFY(track.getNextKeyFrame(40) == NULL);
+	QVERIFY(track.isKeyFrame(30));
+	QVERIFY(!track.isKeyFrame(31));
+
+	track.removeKey(20);
+	QCOMPARE(track.getPrevKeyFrame(25)->row, 10);
+	QCOMPARE(track.lowerBound(11)->row, 30);
+	QVERIFY(track.lowerBound(41) == track.end());
+
+	int prev = -1;
+	for (SyncTrack::const_iterator it = track.begin(); it != track.end(); ++it) {
+		QVERIFY(it->row > prev);
+		prev = it->row;
+	}
+}
+
+void SyncDocumentTest::swapTrackOrder()
+{
+	SyncDocument doc;
+	SyncTrack *a = doc.createTrack("a");
+	SyncTrack *b = doc.createTrack("b");
+	SyncTrack *c = doc.createTrack("c");
+	SyncPage *page = doc.findSyncPage("default");
+
+	QCOMPARE(page->getTrackIndex(a), 0);
+	QCOMPARE(page->getTrackIndex(c), 2);
+
+	page->swapTrackOrder(0, 2);
+	QVERIFY(page->getTrack(0) == c);
+	QCOMPARE(page->getTrackIndex(a), 2);
+	QCOMPARE(page->getTrackIndex(b), 1);
+	QCOMPARE(page->getTrackIndex(c), 0);
+}
+
+void SyncDocumentTest::batchedChanges()
+{
+	SyncDocument doc;
+	SyncTrack *t = doc.createTrack("t");
+	SyncPage *page = doc.findSyncPage("default");
+	QSignalSpy spy(page, SIGNAL(trackDataChanged(int, int, int)));
+
+	SyncTrack::TrackKey k;
+	k.type = SyncTrack::TrackKey::STEP;
+	k.value = 1.0f;
+
+	doc.beginMacro("paste");
+	for (k.row = 0; k.row < 100; k.row += 2)
+		doc.setKeyFrame(t, k);
+	QCOMPARE(spy.count(), 0);
+	doc.endMacro();
+
+	// every key merges into one interval, clamped to the document
+	QCOMPARE(spy.count(), 1);
+	QCOMPARE(spy.at(0).at(1).toInt(), 0);
+	QCOMPARE(spy.at(0).at(2).toInt(), doc.getRows());
+
+	// edits far apart stay apart
+	spy.clear();
+	doc.beginMacro("bias");
+	k.value = 2.0f;
+	k.row = 10;
+	doc.setKeyFrame(t, k);
+	k.row = 90;
+	doc.setKeyFrame(t, k);
+	doc.endMacro();
+	QCOMPARE(spy.count(), 2);
+	QCOMPARE(spy.at(0).at(1).toInt(), 8);
+	QCOMPARE(spy.at(0).at(2).toInt(), 11);
+	QCOMPARE(spy.at(1).at(1).toInt(), 88);
+	QCOMPARE(spy.at(1).at(2).toInt(), 91);
+
+	spy.clear();
+	doc.undo();
+	QCOMPARE(spy.count(), 2);
+
+	// a step key inside a ramp cuts short the interpolation of every row
+	// after it, up to the next key, and removing it brings that back
+	SyncTrack *r = doc.createTrack("r");
+	k.type = SyncTrack::TrackKey::LINEAR;
+	k.row = 20;
+	doc.setKeyFrame(r, k);
+	k.row = 60;
+	doc.setKeyFrame(r, k);
+
+	spy.clear();
+	k.type = SyncTrack::TrackKey::STEP;
+	k.row = 40;
+	doc.setKeyFrame(r, k);
+	QCOMPARE(spy.count(), 1);
+	QCOMPARE(spy.at(0).at(1).toInt(), 20);
+	QCOMPARE(spy.at(0).at(2).toInt(), 59);
+
+	spy.clear();
+	doc.deleteKeyFrame(r, 40);
+	QCOMPARE(spy.count(), 1);
+	QCOMPARE(spy.at(0).at(1).toInt(), 20);
+	QCOMPARE(spy.at(0).at(2).toInt(), 59);
+}
+
+void SyncDocumentTest::replaceKeys()
+{
+	SyncDocument doc;
+	SyncTrack *t = doc.createTrack("t");
+
+	SyncTrack::TrackKey k;
+	k.type = SyncTrack::TrackKey::LINEAR;
+	for (k.row = 0; k.row < 50; k.row += 10) {
+		k.value = float(k.row);
+		doc.setKeyFrame(t, k);
+	}
+	QVector<SyncTrack::TrackKey> before = t->getKeys();
+
+	// two keys in place of three
+	QVector<SyncTrack::TrackKey> keys;
+	k.value = -1.0f;
+	k.row = 15;
+	keys.append(k);
+	k.row = 25;
+	keys.append(k);
+	doc.replaceKeys(t, 10, 30, keys);
+	QCOMPARE(t->getKeyCount(), 4);
+	QCOMPARE(t->getPrevKeyFrame(29)->row, 25);
+	QCOMPARE(t->getNextKeyFrame(25)->row, 40);
+
+	doc.undo();
+	QVERIFY(t->getKeys() == before);
+	doc.redo();
+	QCOMPARE(t->getKeys(10, 30).size(), 2);
+}
+
+void SyncDocumentTest::keyBlock()
+{
+	SyncDocument doc;
+	doc.setRows(12000);
+	SyncTrack *a = doc.createTrack("a");
+	SyncTrack *b = doc.createTrack("b");
+
+	// deltas from one to several varint bytes, and a value %g can't hold
+	SyncTrack::TrackKey k;
+	k.type = SyncTrack::TrackKey::LINEAR;
+	k.row = 100; k.value = 1.0f; doc.setKeyFrame(a, k);
+	k.row = 101; k.value = 2.0f; doc.setKeyFrame(a, k);
+	k.type = SyncTrack::TrackKey::SMOOTH;
+	k.row = 300; k.value = 3.1415927f; doc.setKeyFrame(a, k);
+	k.type = SyncTrack::TrackKey::STEP;
+	k.row = 5099; k.value = -4.5f; doc.setKeyFrame(a, k);
+
+	QVector<QVector<SyncTrack::TrackKey> > columns;
+	columns << a->getKeys(100, 5099) << b->getKeys(100, 5099);
+	QByteArray data = encodeKeyBlock(columns, 100, 5000);
+
+	QVector<QVector<SyncTrack::TrackKey> > decoded;
+	int height;
+	QVERIFY(decodeKeyBlock(data, doc.getRows(), &decoded, &height));
+	QCOMPARE(height, 5000);
+	QCOMPARE(decoded.size(), 2);
+	QCOMPARE(decoded[0].size(), 4);
+	QVERIFY(decoded[1].isEmpty());
+	for (int i = 0; i < columns[0].size(); ++i) {
+		QCOMPARE(decoded[0][i].row, columns[0][i].row - 100);
+		QCOMPARE(decoded[0][i].value, columns[0][i].value);
+		QCOMPARE(decoded[0][i].type, columns[0][i].type);
+	}
+
+	// taller than the document, or cut short
+	QVERIFY(!decodeKeyBlock(data, 4999, &decoded, &height));
+	QVERIFY(!decodeKeyBlock(data.left(data.size() - 1), doc.getRows(), &decoded, &height));
+	QVERIFY(decodeKeyBlock(data, doc.getRows(), &decoded, &height));
+
+	// a delta that wraps around to an earlier row, and a varint too long
+	// for 32 bits
+	QByteArray key("\0\0\0\0\0", 5);
+	QByteArray wrapped = QByteArray("\x01\x64\x02\x32", 4) + key +
+	                     QByteArray("\xff\xff\xff\xff\x0f", 5) + key;
+	QVERIFY(!decodeKeyBlock(wrapped, doc.getRows(), &decoded, &height));
+	QByteArray overlong = QByteArray("\x01\xe4\x80\x80\x80\x10\x00", 7);
+	QVERIFY(!decodeKeyBlock(overlong, INT_MAX, &decoded, &height));
+	QVERIFY(decodeKeyBlock(data, doc.getRows(), &decoded, &height));
+
+	// paste into b, the way the track view does
+	doc.beginMacro("paste");
+	QVector<SyncTrack::TrackKey> keys = decoded[0];
+	for (int i = 0; i < keys.size(); ++i)
+		keys[i].row += 6000;
+	doc.replaceKeys(b, 6000, 6000 + height - 1, keys);
+	doc.endMacro();
+	QCOMPARE(b->getKeyCount(), 4);
+	QCOMPARE(b->getKeyFrame(6200).value, 3.1415927f);
+	QCOMPARE(b->getKeyFrame(10999).value, -4.5f);
+
+	// and bias part of it
+	doc.beginMacro("bias");
+	keys = b->getKeys(6000, 6200);
+	QCOMPARE(keys.size(), 3);
+	for (int i = 0; i < keys.size(); ++i)
+		keys[i].value += 1.0f;
+	doc.replaceKeys(b, 6000, 6200, keys);
+	doc.endMacro();
+	QCOMPARE(b->getKeyFrame(6000).value, 2.0f);
+	QCOMPARE(b->getKeyFrame(6001).value, 3.0f);
+	QCOMPARE(b->getKeyFrame(6200).value, 3.1415927f + 1.0f);
+	QCOMPARE(b->getKeyFrame(6200).type, SyncTrack::TrackKey::SMOOTH);
+	QCOMPARE(b->getKeyFrame(10999).value, -4.5f);
+
+	// a's keys were never touched
+	QVERIFY(a->getKeys() == columns[0]);
+}
+
+void SyncDocumentTest::loadKeys()
+{
+	SyncDocument doc;
+	SyncTrack *t = doc.createTrack("t");
+	QSignalSpy spy(doc.getSyncPage(0), SIGNAL(trackDataChanged(int, int, int)));
+
+	// out of order, and the last key on a row wins
+	QVector<SyncTrack::TrackKey> keys;
+	SyncTrack::TrackKey k;
+	k.type = SyncTrack::TrackKey::STEP;
+	int rows[] = { 8, 2, 8, 4 };
+	for (int i = 0; i < 4; ++i) {
+		k.row = rows[i];
+		k.value = float(i);
+		keys.append(k);
+	}
+	t->loadKeys(keys);
+
+	QCOMPARE(spy.count(), 0);
+	QCOMPARE(t->getKeyCount(), 3);
+	QCOMPARE(t->getKeyFrame(2).value, 1.0f);
+	QCOMPARE(t->getKeyFrame(4).value, 3.0f);
+	QCOMPARE(t->getKeyFrame(8).value, 2.0f);
+}
+
+void SyncDocumentTest::undoMemoryLimit()
+{
+	SyncDocument doc;
+	SyncTrack *t = doc.createTrack("t");
+	doc.setUndoMemoryLimit(4096);
+
+	SyncTrack::TrackKey k;
+	k.type = SyncTrack::TrackKey::STEP;
+	k.value = 1.0f;
+	for (k.row = 0; k.row < 1000; ++k.row)
+		doc.setKeyFrame(t, k);
+
+	// only the newest steps fit, the rest of the keys stay put
+	int undone = 0;
+	while (doc.canUndo()) {
+		doc.undo();
+		++undone;
+	}
+	QVERIFY(undone > 0);
+	QVERIFY(undone < 1000);
+	QCOMPARE(t->getKeyCount(), 1000 - undone);
+}
+
+void SyncDocumentTest::saveLoad()
+{
+	SyncDocument doc;
+	SyncTrack *a = doc.createTrack("a");
+	doc.createTrack("b");
+	doc.toggleRowBookmark(8);
+
+	SyncTrack::TrackKey k;
+	k.row = 0;
+	k.value = 0.5f;
+	k.type = SyncTrack::TrackKey::LINEAR;
+	a->setKey(k);
+	k.row = 4;
+	k.value = 0.0f;
+	k.type = SyncTrack::TrackKey::STEP;
+	a->setKey(k);
+
+	QTemporaryDir dir;
+	QString fileName = dir.path() + "/test.rocket";
+	QVERIFY(doc.save(fileName));
+
+	// exactly what the DOM-based writer produced
+	QFile file(fileName);
+	QVERIFY(file.open(QIODevice::ReadOnly | QIODevice::Text));
+	QCOMPARE(QString::fromUtf8(file.readAll()),
+	         QString("<sync rows=\"128\">\n"
+	                 "\t<tracks>\n"
+	                 "\t\t<track name=\"a\">\n"
+	                 "\t\t\t<key row=\"0\" interpolation=\"1\" value=\"0.5\"/>\n"
+	                 "\t\t\t<key row=\"4\" interpolation=\"0\" value=\"0\"/>\n"
+	                 "\t\t</track>\n"
+	                 "\t\t<track name=\"b\"/>\n"
+	                 "\t</tracks>\n"
+	                 "\t<bookmarks>\n"
+	                 "\t\t<bookmark row=\"8\"/>\n"
+	                 "\t</bookmarks>\n"
+	                 "</sync>\n"));
+	file.close();
+
+	SyncDocument *loaded = SyncDocument::load(fileName);
+	QVERIFY(loaded);
+	QCOMPARE(loaded->getRows(), 128);
+	QCOMPARE(loaded->getTrackCount(), 2);
+	QVERIFY(loaded->findTrack("a")->getKeys() == a->getKeys());
+	QCOMPARE(loaded->findTrack("b")->getKeyCount(), 0);
+	QVERIFY(loaded->isRowBookmark(8));
+	delete loaded;
+}
+
+void SyncDocumentTest::backgroundSave()
+{
+	SyncDocument doc;
+	SyncTrack *a = doc.createTrack("a");
+	SyncTrack::TrackKey k;
+	k.type = SyncTrack::TrackKey::LINEAR;
+	for (k.row = 0; k.row < 1000; k.row += 2) {
+		k.value = k.row * 0.5f;
+		doc.setKeyFrame(a, k);
+	}
+
+	QTemporaryDir dir;
+	QString fileName = dir.path() + "/test.rocket";
+
+	// edits made while it runs are neither saved nor marked clean
+	QFuture<QString> future = doc.saveInBackground(fileName);
+	QVector<SyncTrack::TrackKey> saved = a->getKeys();
+	doc.deleteKeyFrame(a, 0);
+	future.waitForFinished();
+	QCOMPARE(future.result(), QString());
+	doc.saveFinished(fileName, true);
+	QVERIFY(doc.isModified());
+
+	SyncDocument *loaded = SyncDocument::load(fileName);
+	QVERIFY(loaded);
+	QVERIFY(loaded->findTrack("a")->getKeys() == saved);
+
+	// the same bytes as a plain save
+	QString syncName = dir.path() + "/sync.rocket";
+	QVERIFY(loaded->save(syncName));
+	QFile file(fileName), syncFile(syncName);
+	QVERIFY(file.open(QIODevice::ReadOnly) && syncFile.open(QIODevice::ReadOnly));
+	QCOMPARE(file.readAll(), syncFile.readAll());
+	delete loaded;
+
+	// an undo and a new edit leave the stack index where it was
+	k.row = 1;
+	future = doc.saveInBackground(fileName);
+	doc.undo();
+	doc.setKeyFrame(a, k);
+	future.waitForFinished();
+	doc.saveFinished(fileName, true);
+	QVERIFY(doc.isModified());
+}
+
+void SyncDocumentTest::parallelLoad()
+{
+	// big enough to have its tracks parsed on the thread pool
+	SyncDocument doc;
+	doc.createTrack("b");
+	doc.createTrack("page:a");
+	doc.createTrack("c");
+	SyncTrack::TrackKey k;
+	k.type = SyncTrack::TrackKey::SMOOTH;
+	for (int i = 0; i < doc.getTrackCount(); ++i) {
+		QVector<SyncTrack::TrackKey> keys;
+		for (k.row = i; k.row < 60000; k.row += 3) {
+			k.value = k.row * 0.25f;
+			keys.append(k);
+		}
+		doc.getTrack(i)->loadKeys(keys);
+	}
+	doc.toggleRowBookmark(16);
+
+	QTemporaryDir dir;
+	QString fileName = dir.path() + "/test.rocket";
+	QVERIFY(doc.save(fileName));
+	QVERIFY(QFileInfo(fileName).size() > 1 << 20);
+
+	SyncDocument *loaded = SyncDocument::load(fileName);
+	QVERIFY(loaded);
+	QCOMPARE(loaded->getTrackCount(), 3);
+	QCOMPARE(loaded->getSyncPageCount(), 2);
+	for (int i = 0; i < doc.getTrackCount(); ++i) {
+		const SyncTrack *t = doc.getTrack(i);
+		QVERIFY(loaded->findTrack(t->getName())->getKeys() == t->getKeys());
+	}
+
+	// in the order of the file
+	QCOMPARE(loaded->getTrack(0)->getName(), QString("b"));
+	QCOMPARE(loaded->getTrack(1)->getName(), QString("c"));
+	QCOMPARE(loaded->getTrack(2)->getName(), QString("page:a"));
+	QVERIFY(loaded->isRowBookmark(16));
+	delete loaded;
+}
+
+void SyncDocumentTest::compressedSaveLoad()
+{
+	SyncDocument doc;
+	SyncTrack *a = doc.createTrack("a");
+	SyncTrack::TrackKey k;
+	k.type = SyncTrack::TrackKey::LINEAR;
+	for (k.row = 0; k.row < 50000; k.row += 5) {
+		k.value = k.row * 0.5f;
+		a->setKey(k);
+	}
+
+	QTemporaryDir dir;
+	QString plainName = dir.path() + "/test.rocket";
+	QString gzName = dir.path() + "/test.rocket.gz";
+	QVERIFY(doc.save(plainName));
+	QVERIFY(doc.save(gzName));
+
+	QFile gz(gzName);
+	QVERIFY(gz.open(QIODevice::ReadOnly));
+	QCOMPARE(gz.peek(2), QByteArray("\x1f\x8b", 2));
+	QVERIFY(gz.size() < QFileInfo(plainName).size() / 4);
+	gz.close();
+
+	// found by the magic bytes, not the name
+	QString renamed = dir.path() + "/renamed.rocket";
+	QVERIFY(QFile::rename(gzName, renamed));
+	SyncDocument *loaded = SyncDocument::load(renamed);
+	QVERIFY(loaded);
+	QVERIFY(loaded->findTrack("a")->getKeys() == a->getKeys());
+
+	// and saved back the way it came
+	QVERIFY(loaded->save(renamed));
+	delete loaded;
+	QFile again(renamed);
+	QVERIFY(again.open(QIODevice::ReadOnly));
+	QCOMPARE(again.peek(2), QByteArray("\x1f\x8b", 2));
+}
+
+void SyncDocumentTest::binaryRoundTrip()
+{
+	SyncDocument doc;
+	SyncTrack *a = doc.createTrack("a");
+	doc.createTrack("page:b");
+	doc.toggleRowBookmark(3);
+	doc.setRows(1000);
+
+	SyncTrack::TrackKey k;
+	k.type = SyncTrack::TrackKey::SMOOTH;
+	for (k.row = 0; k.row < 100; k.row += 3) {
+		k.value = k.row * 0.1f;
+		a->setKey(k);
+	}
+
+	// more significant digits than the XML writes by default
+	k.row = 200;
+	k.value = 3.1415927f;
+	a->setKey(k);
+	k.row = 201;
+	k.value = 1234.567f;
+	a->setKey(k);
+
+	QTemporaryDir dir;
+	QString xmlName = dir.path() + "/test.rocket";
+	QString binName = dir.path() + "/test.rocketb";
+	QVERIFY(doc.save(xmlName));
+	QVERIFY(doc.save(binName));
+
+	// either format keeps every value exactly
+	SyncDocument *fromXml = SyncDocument::load(xmlName);
+	QVERIFY(fromXml);
+	QVERIFY(fromXml->findTrack("a")->getKeys() == a->getKeys());
+	delete fromXml;
+
+	// binary back to XML gives the same bytes
+	SyncDocument *loaded = SyncDocument::load(binName);
+	QVERIFY(loaded);
+	QString xmlName2 = dir.path() + "/test2.rocket";
+	QVERIFY(loaded->save(xmlName2));
+	QFile xml(xmlName), xml2(xmlName2);
+	QVERIFY(xml.open(QIODevice::ReadOnly) && xml2.open(QIODevice::ReadOnly));
+	QCOMPARE(xml2.readAll(), xml.readAll());
+
+	// small edits are written in place
+	qint64 size = QFileInfo(binName).size();
+	SyncTrack *la = loaded->findTrack("a");
+	k.row = 1;
+	la->setKey(k);
+	loaded->setRows(2000);
+	QVERIFY(loaded->save(binName));
+	QCOMPARE(QFileInfo(binName).size(), size);
+
+	SyncDocument *reloaded = SyncDocument::load(binName);
+	QVERIFY(reloaded);
+	QCOMPARE(reloaded->getRows(), 2000);
+	QVERIFY(reloaded->findTrack("a")->getKeys() == la->getKeys());
+	QVERIFY(reloaded->isRowBookmark(3));
+	delete reloaded;
+	QVERIFY(!QFile::exists(binName + ".update"));
+
+	// an in-place save cut short is finished by the next load: here, one
+	// write of the row count in the header
+	QByteArray update("RKTU\x01\0\0\0"
+	                  "\x08\0\0\0\0\0\0\0\x04\0\0\0"
+	                  "\xb8\x0b\0\0", 24);
+	quint16 sum = qChecksum(update.constData(), uint(update.size()));
+	update.append(char(sum & 0xff)).append(char(sum >> 8));
+	QFile updateFile(binName + ".update");
+	QVERIFY(updateFile.open(QIODevice::WriteOnly));
+	QCOMPARE(updateFile.write(update), qint64(update.size()));
+	updateFile.close();
+
+	reloaded = SyncDocument::load(binName);
+	QVERIFY(reloaded);
+	QCOMPARE(reloaded->getRows(), 3000);
+	QVERIFY(reloaded->findTrack("a")->getKeys() == la->getKeys());
+	QVERIFY(!QFile::exists(binName + ".update"));
+	delete reloaded;
+	delete loaded;
+}
+
+void SyncDocumentTest::journalRecovery()
+{
+	QTemporaryDir dir;
+	QString fileName = dir.path() + "/test.rocket";
+
+	SyncDocument *doc = new SyncDocument;
+	SyncTrack *a = doc->createTrack("a");
+	SyncTrack::TrackKey k;
+	k.row = 0;
+	k.value = 1.0f;
+	k.type = SyncTrack::TrackKey::LINEAR;
+	doc->setKeyFrame(a, k);
+	QVERIFY(doc->save(fileName));
+	QVERIFY(!SyncJournal::isRecoverable(fileName));
+	QVERIFY(!QFile::exists(SyncJournal::getFileName(fileName)));
+
+	// edits since the save, then gone without saving again
+	k.row = 8;
+	k.value = 2.0f;
+	doc->setKeyFrame(a, k);
+	doc->deleteKeyFrame(a, 0);
+	doc->setKeyFrame(doc->createTrack("b"), k);
+	doc->setRows(256);
+	doc->toggleRowBookmark(4);
+	QVector<SyncTrack::TrackKey> keys = a->getKeys();
+	delete doc;
+
+	SyncDocument *loaded = SyncDocument::load(fileName);
+	QVERIFY(loaded);
+	QVERIFY(loaded->hasRecoverableJournal());
+	QVERIFY(loaded->recoverJournal());
+	QCOMPARE(loaded->getRows(), 256);
+	QVERIFY(loaded->isRowBookmark(4));
+	QVERIFY(loaded->findTrack("a")->getKeys() == keys);
+	QVERIFY(loaded->findTrack("b")->isKeyFrame(8));
+	QVERIFY(loaded->isModified());
+
+	// and one undo takes the keys back to the file
+	loaded->undo();
+	QCOMPARE(loaded->findTrack("a")->getKeyCount(), 1);
+	QVERIFY(loaded->findTrack("a")->isKeyFrame(0));
+
+	loaded->discardJournal();
+	QVERIFY(!SyncJournal::isRecoverable(fileName));
+
+	// written from the first edit on, and gone once closed clean again
+	loaded->startJournal(fileName);
+	QVERIFY(!QFile::exists(SyncJournal::getFileName(fileName)));
+	loaded->setKeyFrame(loaded->findTrack("a"), k);
+	QCoreApplication::processEvents();
+	QVERIFY(QFile::exists(SyncJournal::getFileName(fileName)));
+	loaded->undo();
+	QVERIFY(!loaded->isModified());
+	delete loaded;
+	QVERIFY(!QFile::exists(SyncJournal::getFileName(fileName)));
+}
+
+// the journal needs an event loop for its timer
+QTEST_GUILESS_MAIN(SyncDocumentTest)
 
 #include "tst_syncdocument.moc"
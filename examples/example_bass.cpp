@@ -168,7 +168,9 @@ int main(int argc, char *argv[])
 		die("out of memory?");
 
 #ifndef SYNC_PLAYER
-	if (sync_tcp_connect(rocket, "localhost", SYNC_DEFAULT_PORT))
+	/* prefer a local editor over shared memory, fall back to TCP */
+	if (sync_shm_connect(rocket, SYNC_DEFAULT_SHM_NAME) &&
+	    sync_tcp_connect(rocket, "localhost", SYNC_DEFAULT_PORT))
 		die("failed to connect to host");
 #endif
 
@@ -187,7 +189,8 @@ int main(int argc, char *argv[])
 	while (!done) {
 		double row = bass_get_row(stream);
 #ifndef SYNC_PLAYER
-		if (sync_update(rocket, (int)floor(row), &bass_cb, (void *)&stream))
+		if (sync_update(rocket, (int)floor(row), &bass_cb, (void *)&stream) &&
+		    sync_shm_connect(rocket, SYNC_DEFAULT_SHM_NAME))
 			sync_tcp_connect(rocket, "localhost", SYNC_DEFAULT_PORT);
 #endif
 
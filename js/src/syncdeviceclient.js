@@ -7,7 +7,9 @@ JSRocket.SyncDeviceClient = function (cfg) {
         CMD_GET_TRACK = 2,
         CMD_SET_ROW = 3,
         CMD_PAUSE = 4,
-        CMD_SAVE_TRACKS = 5;
+        CMD_SAVE_TRACKS = 5,
+        CMD_PING = 6,
+        CMD_PONG = 7;
 
     var _ws = new WebSocket(cfg.socketURL),
         _syncData = new JSRocket.SyncData(),
@@ -33,53 +35,77 @@ JSRocket.SyncDeviceClient = function (cfg) {
     function onMessage(e) {
 
         var queue = (new Uint8Array(e.data)),
-            cmd = queue[0],
-            track, row, value, interpolation;
+            pos = 0,
+            cmd, track, row, value, interpolation;
 
         //Handshake
-        if (cmd === 104) {
+        if (queue[0] === 104) {
 
             _eventHandler.ready();
+            return;
+        }
+
+        //the editor batches several commands into one message
+        while (pos < queue.length) {
+
+            cmd = queue[pos];
 
             //PAUSE
-        } else if (CMD_PAUSE === cmd) {
+            if (CMD_PAUSE === cmd) {
 
-            if( queue[1] === 1) {
-                _eventHandler.pause();
-            } else {
-                _eventHandler.play();
-            }
+                if( queue[pos + 1] === 1) {
+                    _eventHandler.pause();
+                } else {
+                    _eventHandler.play();
+                }
+                pos += 2;
+
+                //SET_ROW
+            } else if (CMD_SET_ROW === cmd) {
 
-            //SET_ROW
-        } else if (CMD_SET_ROW === cmd) {
+                row = toInt(queue.subarray(pos + 1, pos + 5));
 
-            row = toInt(queue.subarray(1, 5));
+                _eventHandler.update(row);
+                pos += 5;
 
-            _eventHandler.update(row);
+                //SET_KEY
+            } else if (CMD_SET_KEY === cmd) {
 
-            //SET_KEY
-        } else if (CMD_SET_KEY === cmd) {
+                track = toInt(queue.subarray(pos + 1, pos + 5));
+                row = toInt(queue.subarray(pos + 5, pos + 9));
 
-            track = toInt(queue.subarray(1, 5));
-            row = toInt(queue.subarray(5, 9));
+                //value = Math.round(toFloat(queue.subarray(pos + 9, pos + 13)) * 100) / 100; //round to what's seen in Rocket tracks
+                value = toFloat(queue.subarray(pos + 9, pos + 13)); //use the values you see in Rocket statusbar
 
-            //value = Math.round(toFloat(queue.subarray(9, 13)) * 100) / 100; //round to what's seen in Rocket tracks
-            value = toFloat(queue.subarray(9, 13)); //use the values you see in Rocket statusbar
+                interpolation = toInt(queue.subarray(pos + 13, pos + 14));
+                _syncData.getTrack(track).add(row, value, interpolation);
+                pos += 14;
 
-            interpolation = toInt(queue.subarray(13, 14));
-            _syncData.getTrack(track).add(row, value, interpolation);
+                //DELETE
+            } else if (CMD_DELETE_KEY === cmd) {
 
-            //DELETE
-        } else if (CMD_DELETE_KEY === cmd) {
+                track = toInt(queue.subarray(pos + 1, pos + 5));
+                row = toInt(queue.subarray(pos + 5, pos + 9));
 
-            track = toInt(queue.subarray(1, 5));
-            row = toInt(queue.subarray(5, 9));
+                _syncData.getTrack(track).remove(row);
+                pos += 9;
 
-            _syncData.getTrack(track).remove(row);
+                //SAVE
+            } else if (CMD_SAVE_TRACKS === cmd) {
 
-            //SAVE
-        } else if (CMD_SAVE_TRACKS === cmd) {
-            _eventHandler.save();
+                _eventHandler.save();
+                pos += 1;
+
+                //PING, PONG
+            } else if (CMD_PING === cmd || CMD_PONG === cmd) {
+
+                pos += 1;
+
+            } else {
+
+                console.warn(">> unknown command", cmd);
+                return;
+            }
         }
     }
 
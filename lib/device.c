@@ -5,6 +5,7 @@
 #include <math.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 
 #include <sys/stat.h>
 
@@ -86,9 +87,62 @@ enum {
 	GET_TRACK = 2,
 	SET_ROW = 3,
 	PAUSE = 4,
-	SAVE_TRACKS = 5
+	SAVE_TRACKS = 5,
+	PING = 6,
+	PONG = 7
 };
 
+static const char *cmd_names[SYNC_STATS_MAX_CMDS] = {
+	"SET_KEY", "DELETE_KEY", "GET_TRACK", "SET_ROW",
+	"PAUSE", "SAVE_TRACKS", "PING", "PONG"
+};
+
+/* monotonic time in seconds */
+static double sync_time(void)
+{
+#ifdef _WIN32
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER now;
+	if (!freq.QuadPart)
+		QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	return (double)now.QuadPart / freq.QuadPart;
+#elif defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+#else
+	return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+static void trace(struct sync_device *d, const char *name, double start)
+{
+	if (d->trace_cb)
+		d->trace_cb(d->trace_param, name, start, sync_time() - start);
+}
+
+static void chrome_trace_event(void *param, const char *name, double start,
+    double duration)
+{
+	/* Chrome's trace-event format, one complete ("X") event per line */
+	fprintf((FILE *)param, "{\"name\":\"%s\",\"cat\":\"rocket\",\"ph\":\"X\","
+	    "\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":1},\n",
+	    name, start * 1e6, duration * 1e6);
+}
+
+static void close_trace(struct sync_device *d)
+{
+	if (d->trace_cb == chrome_trace_event) {
+		FILE *fp = d->trace_param;
+		fputs("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,"
+		    "\"args\":{\"name\":\"rocket\"}}]\n", fp);
+		fclose(fp);
+	}
+	d->trace_cb = NULL;
+	d->trace_param = NULL;
+}
+
 static inline int socket_poll(SOCKET socket)
 {
 #ifdef GEKKO
@@ -228,6 +282,69 @@ static SOCKET server_connect(const char *host, unsigned short nport)
 	return sock;
 }
 
+/*
+ * The rest of the device talks to the editor through these, so the
+ * byte-stream is the same regardless of transport.
+ */
+
+static int dev_is_connected(const struct sync_device *d)
+{
+#ifdef USE_SHM
+	if (d->shm)
+		return 1;
+#endif
+	return d->sock != INVALID_SOCKET;
+}
+
+static int dev_send(struct sync_device *d, const void *buf, size_t len)
+{
+	d->stats.bytes_out += (unsigned long)len;
+#ifdef USE_SHM
+	if (d->shm)
+		return sync_shm_send(d->shm, buf, len);
+#endif
+	return xsend(d->sock, buf, len, 0);
+}
+
+static int dev_recv(struct sync_device *d, void *buf, size_t len)
+{
+	d->stats.bytes_in += (unsigned long)len;
+#ifdef USE_SHM
+	if (d->shm)
+		return sync_shm_recv(d->shm, buf, len);
+#endif
+	return xrecv(d->sock, buf, len, 0);
+}
+
+static int send_cmd(struct sync_device *d, unsigned char cmd)
+{
+	d->stats.cmds_out[cmd]++;
+	return dev_send(d, (char *)&cmd, 1);
+}
+
+static int dev_poll(struct sync_device *d)
+{
+#ifdef USE_SHM
+	if (d->shm)
+		return sync_shm_poll(d->shm);
+#endif
+	return socket_poll(d->sock);
+}
+
+static void dev_close(struct sync_device *d)
+{
+#ifdef USE_SHM
+	if (d->shm) {
+		sync_shm_detach(d->shm);
+		d->shm = NULL;
+	}
+#endif
+	if (d->sock != INVALID_SOCKET) {
+		closesocket(d->sock);
+		d->sock = INVALID_SOCKET;
+	}
+}
+
 #else
 
 void sync_set_io_cb(struct sync_device *d, struct sync_io_cb *cb)
@@ -271,6 +388,18 @@ struct sync_device *sync_create_device(const char *base)
 #ifndef SYNC_PLAYER
 	d->row = -1;
 	d->sock = INVALID_SOCKET;
+#ifdef USE_SHM
+	d->shm = NULL;
+#endif
+
+	memset(&d->stats, 0, sizeof(d->stats));
+	d->stats.rtt = -1.0;
+	d->last_update = d->ping_time = d->evals_time = 0.0;
+	d->evals_base = 0;
+	d->count_evals = 0;
+	d->peer_pings = d->ping_pending = 0;
+	d->trace_cb = NULL;
+	d->trace_param = NULL;
 #endif
 
 	d->io_cb.open = (void *(*)(const char *, const char *))fopen;
@@ -285,8 +414,8 @@ void sync_destroy_device(struct sync_device *d)
 	int i;
 
 #ifndef SYNC_PLAYER
-	if (d->sock != INVALID_SOCKET)
-		closesocket(d->sock);
+	dev_close(d);
+	close_trace(d);
 #endif
 
 	for (i = 0; i < (int)d->num_tracks; ++i) {
@@ -401,26 +530,24 @@ int sync_save_tracks(const struct sync_device *d)
 
 static int fetch_track_data(struct sync_device *d, struct sync_track *t)
 {
-	unsigned char cmd = GET_TRACK;
 	uint32_t name_len;
 
 	assert(strlen(t->name) <= UINT32_MAX);
 	name_len = htonl((uint32_t)strlen(t->name));
 
 	/* send request data */
-	if (xsend(d->sock, (char *)&cmd, 1, 0) ||
-	    xsend(d->sock, (char *)&name_len, sizeof(name_len), 0) ||
-	    xsend(d->sock, t->name, (int)strlen(t->name), 0))
+	if (send_cmd(d, GET_TRACK) ||
+	    dev_send(d, (char *)&name_len, sizeof(name_len)) ||
+	    dev_send(d, t->name, (int)strlen(t->name)))
 	{
-		closesocket(d->sock);
-		d->sock = INVALID_SOCKET;
+		dev_close(d);
 		return -1;
 	}
 
 	return 0;
 }
 
-static int handle_set_key_cmd(SOCKET sock, struct sync_device *data)
+static int handle_set_key_cmd(struct sync_device *data)
 {
 	uint32_t track, row;
 	union {
@@ -430,10 +557,10 @@ static int handle_set_key_cmd(SOCKET sock, struct sync_device *data)
 	struct track_key key;
 	unsigned char type;
 
-	if (xrecv(sock, (char *)&track, sizeof(track), 0) ||
-	    xrecv(sock, (char *)&row, sizeof(row), 0) ||
-	    xrecv(sock, (char *)&v.i, sizeof(v.i), 0) ||
-	    xrecv(sock, (char *)&type, 1, 0))
+	if (dev_recv(data, (char *)&track, sizeof(track)) ||
+	    dev_recv(data, (char *)&row, sizeof(row)) ||
+	    dev_recv(data, (char *)&v.i, sizeof(v.i)) ||
+	    dev_recv(data, (char *)&type, 1))
 		return -1;
 
 	track = ntohl(track);
@@ -449,12 +576,12 @@ static int handle_set_key_cmd(SOCKET sock, struct sync_device *data)
 	return sync_set_key(data->tracks[track], &key);
 }
 
-static int handle_del_key_cmd(SOCKET sock, struct sync_device *data)
+static int handle_del_key_cmd(struct sync_device *data)
 {
 	uint32_t track, row;
 
-	if (xrecv(sock, (char *)&track, sizeof(track), 0) ||
-	    xrecv(sock, (char *)&row, sizeof(row), 0))
+	if (dev_recv(data, (char *)&track, sizeof(track)) ||
+	    dev_recv(data, (char *)&row, sizeof(row)))
 		return -1;
 
 	track = ntohl(track);
@@ -466,15 +593,12 @@ static int handle_del_key_cmd(SOCKET sock, struct sync_device *data)
 	return sync_del_key(data->tracks[track], row);
 }
 
-int sync_tcp_connect(struct sync_device *d, const char *host, unsigned short port)
+static int init_connection(struct sync_device *d)
 {
 	int i;
-	if (d->sock != INVALID_SOCKET)
-		closesocket(d->sock);
-
-	d->sock = server_connect(host, port);
-	if (d->sock == INVALID_SOCKET)
-		return -1;
+	d->peer_pings = d->ping_pending = 0;
+	d->ping_time = 0.0;
+	d->stats.rtt = -1.0;
 
 	for (i = 0; i < (int)d->num_tracks; ++i) {
 		free(d->tracks[i]->keys);
@@ -484,80 +608,232 @@ int sync_tcp_connect(struct sync_device *d, const char *host, unsigned short por
 
 	for (i = 0; i < (int)d->num_tracks; ++i) {
 		if (fetch_track_data(d, d->tracks[i])) {
-			closesocket(d->sock);
-			d->sock = INVALID_SOCKET;
+			dev_close(d);
 			return -1;
 		}
 	}
 	return 0;
 }
 
+int sync_tcp_connect(struct sync_device *d, const char *host, unsigned short port)
+{
+	dev_close(d);
+
+	d->sock = server_connect(host, port);
+	if (d->sock == INVALID_SOCKET)
+		return -1;
+
+	return init_connection(d);
+}
+
+int sync_shm_connect(struct sync_device *d, const char *name)
+{
+#ifdef USE_SHM
+	char greet[128];
+
+	dev_close(d);
+
+	d->shm = sync_shm_attach(name);
+	if (!d->shm)
+		return -1;
+
+	if (dev_send(d, CLIENT_GREET, strlen(CLIENT_GREET)) ||
+	    dev_recv(d, greet, strlen(SERVER_GREET)) ||
+	    strncmp(SERVER_GREET, greet, strlen(SERVER_GREET))) {
+		dev_close(d);
+		return -1;
+	}
+
+	return init_connection(d);
+#else
+	(void)d;
+	(void)name;
+	return -1; /* not supported on this platform, use sync_tcp_connect */
+#endif
+}
+
 int sync_connect(struct sync_device *d, const char *host, unsigned short port)
 {
 	return sync_tcp_connect(d, host, port);
 }
 
-int sync_update(struct sync_device *d, int row, struct sync_cb *cb,
+static int process_commands(struct sync_device *d, struct sync_cb *cb,
     void *cb_param)
 {
-	if (d->sock == INVALID_SOCKET)
-		return -1;
-
-	/* look for new commands */
-	while (socket_poll(d->sock)) {
+	while (dev_poll(d)) {
 		unsigned char cmd = 0, flag;
 		uint32_t new_row;
-		if (xrecv(d->sock, (char *)&cmd, 1, 0))
-			goto sockerr;
+		double start = sync_time();
+		if (dev_recv(d, (char *)&cmd, 1))
+			return -1;
+
+		if (cmd < SYNC_STATS_MAX_CMDS)
+			d->stats.cmds_in[cmd]++;
 
 		switch (cmd) {
 		case SET_KEY:
-			if (handle_set_key_cmd(d->sock, d))
-				goto sockerr;
+			if (handle_set_key_cmd(d))
+				return -1;
 			break;
 		case DELETE_KEY:
-			if (handle_del_key_cmd(d->sock, d))
-				goto sockerr;
+			if (handle_del_key_cmd(d))
+				return -1;
 			break;
 		case SET_ROW:
-			if (xrecv(d->sock, (char *)&new_row, sizeof(new_row), 0))
-				goto sockerr;
+			if (dev_recv(d, (char *)&new_row, sizeof(new_row)))
+				return -1;
 			if (cb && cb->set_row)
 				cb->set_row(cb_param, ntohl(new_row));
 			break;
 		case PAUSE:
-			if (xrecv(d->sock, (char *)&flag, 1, 0))
-				goto sockerr;
+			if (dev_recv(d, (char *)&flag, 1))
+				return -1;
 			if (cb && cb->pause)
 				cb->pause(cb_param, flag);
 			break;
 		case SAVE_TRACKS:
 			sync_save_tracks(d);
 			break;
+		case PING:
+			d->peer_pings = 1;
+			if (send_cmd(d, PONG))
+				return -1;
+			break;
+		case PONG:
+			if (d->ping_pending) {
+				d->stats.rtt = sync_time() - d->ping_time;
+				d->ping_pending = 0;
+			}
+			break;
 		default:
 			fprintf(stderr, "unknown cmd: %02x\n", cmd);
-			goto sockerr;
+			return -1;
 		}
+
+		trace(d, cmd_names[cmd], start);
 	}
+	return 0;
+}
+
+static int update_connection(struct sync_device *d, int row,
+    struct sync_cb *cb, void *cb_param)
+{
+	if (!dev_is_connected(d))
+		return -1;
+
+	/* look for new commands */
+	if (process_commands(d, cb, cb_param))
+		goto sockerr;
 
 	if (cb && cb->is_playing && cb->is_playing(cb_param)) {
-		if (d->row != row && d->sock != INVALID_SOCKET) {
-			unsigned char cmd = SET_ROW;
+		if (d->row != row && dev_is_connected(d)) {
 			uint32_t nrow = htonl(row);
-			if (xsend(d->sock, (char*)&cmd, 1, 0) ||
-			    xsend(d->sock, (char*)&nrow, sizeof(nrow), 0))
+			if (send_cmd(d, SET_ROW) ||
+			    dev_send(d, (char*)&nrow, sizeof(nrow)))
 				goto sockerr;
 			d->row = row;
 		}
 	}
+
+	/*
+	 * Editors that predate PING silently skip it, so one unanswered
+	 * ping is all it costs to find out.
+	 */
+	if (!d->ping_pending && sync_time() - d->ping_time >= 1.0) {
+		if (send_cmd(d, PING))
+			goto sockerr;
+		d->ping_pending = 1;
+		d->ping_time = sync_time();
+	}
 	return 0;
 
 sockerr:
-	closesocket(d->sock);
-	d->sock = INVALID_SOCKET;
+	dev_close(d);
 	return -1;
 }
 
+static void update_eval_rate(struct sync_device *d, double now)
+{
+	unsigned long evals = 0;
+	int i;
+	for (i = 0; i < (int)d->num_tracks; ++i)
+		evals += get_num_evals(d->tracks[i]);
+
+	if (d->evals_time > 0.0)
+		d->stats.evals_per_sec = (evals - d->evals_base) /
+		    (now - d->evals_time);
+	d->evals_base = evals;
+	d->evals_time = now;
+}
+
+int sync_update(struct sync_device *d, int row, struct sync_cb *cb,
+    void *cb_param)
+{
+	double start = sync_time(), end;
+	int ret;
+
+	if (d->last_update > 0.0 &&
+	    start - d->last_update > d->stats.worst_stall)
+		d->stats.worst_stall = start - d->last_update;
+	d->last_update = start;
+
+	ret = update_connection(d, row, cb, cb_param);
+
+	end = sync_time();
+	d->stats.update_time += end - start;
+	if (d->count_evals && end - d->evals_time >= 1.0)
+		update_eval_rate(d, end);
+
+	trace(d, "sync_update", start);
+	return ret;
+}
+
+int sync_get_stats(const struct sync_device *d, struct sync_stats *stats)
+{
+	*stats = d->stats;
+	stats->num_tracks = d->num_tracks;
+	return 0;
+}
+
+void sync_reset_stats(struct sync_device *d)
+{
+	double rtt = d->stats.rtt, evals_per_sec = d->stats.evals_per_sec;
+	memset(&d->stats, 0, sizeof(d->stats));
+	d->stats.rtt = rtt;
+	d->stats.evals_per_sec = evals_per_sec;
+	d->last_update = 0.0;
+}
+
+void sync_count_evals(struct sync_device *d, int enable)
+{
+	size_t i;
+	d->count_evals = !!enable;
+	for (i = 0; i < d->num_tracks; ++i)
+		d->tracks[i]->count_evals = d->count_evals;
+
+	/* start over, rather than average across the time it was off */
+	d->stats.evals_per_sec = 0.0;
+	d->evals_time = 0.0;
+}
+
+void sync_set_trace_cb(struct sync_device *d, sync_trace_fn cb, void *param)
+{
+	close_trace(d);
+	d->trace_cb = cb;
+	d->trace_param = param;
+}
+
+int sync_trace_to_file(struct sync_device *d, const char *path)
+{
+	FILE *fp = fopen(path, "w");
+	if (!fp)
+		return -1;
+
+	fputs("[\n", fp);
+	sync_set_trace_cb(d, chrome_trace_event, fp);
+	return 0;
+}
+
 #endif /* !defined(SYNC_PLAYER) */
 
 static int create_track(struct sync_device *d, const char *name)
@@ -573,6 +849,10 @@ static int create_track(struct sync_device *d, const char *name)
 	t->name = strdup(name);
 	t->keys = NULL;
 	t->num_keys = 0;
+#ifndef SYNC_PLAYER
+	t->count_evals = d->count_evals;
+	t->num_evals = 0;
+#endif
 
 	tmp = realloc(d->tracks, sizeof(d->tracks[0]) * (d->num_tracks + 1));
 	if (!tmp) {
@@ -601,7 +881,7 @@ const struct sync_track *sync_get_track(struct sync_device *d,
 	t = d->tracks[idx];
 
 #ifndef SYNC_PLAYER
-	if (d->sock != INVALID_SOCKET)
+	if (dev_is_connected(d))
 		fetch_track_data(d, t);
 	else
 #endif
@@ -53,6 +53,10 @@
  #define closesocket(x) close(x)
 #endif
 
+#ifdef USE_SHM
+ #include "shm.h"
+#endif
+
 #endif /* !defined(SYNC_PLAYER) */
 
 struct sync_device {
@@ -63,6 +67,18 @@ struct sync_device {
 #ifndef SYNC_PLAYER
 	int row;
 	SOCKET sock;
+#ifdef USE_SHM
+	struct sync_shm *shm;
+#endif
+
+	struct sync_stats stats;
+	double last_update, ping_time, evals_time;
+	unsigned long evals_base;
+	int count_evals;
+	int peer_pings, ping_pending;
+
+	sync_trace_fn trace_cb;
+	void *trace_param;
 #endif
 	struct sync_io_cb io_cb;
 };
@@ -0,0 +1,203 @@
+#include "shm.h"
+
+#ifdef USE_SHM
+
+#include <fcntl.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#ifdef __linux__
+ #include <linux/futex.h>
+ #include <sys/syscall.h>
+#endif
+
+#ifndef __GNUC__
+ #error "USE_SHM requires GCC-style atomic builtins"
+#endif
+
+#define shm_load(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define shm_store(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+/* give up on a peer that stops making progress mid-command */
+#define SHM_STALL_TIMEOUT_MS 5000
+
+struct sync_shm {
+	struct sync_shm_segment *seg;
+	struct sync_shm_ring *in, *out;
+	uint32_t session;
+};
+
+static void ring_wake(struct sync_shm_ring *r)
+{
+	/*
+	 * head was just published; without a full fence the load of waiting
+	 * may be done before it, and miss a reader going to sleep
+	 */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (!shm_load(&r->waiting))
+		return;
+#ifdef __linux__
+	syscall(SYS_futex, &r->head, FUTEX_WAKE, 1, NULL, NULL, 0);
+#endif
+}
+
+static void ring_wait(struct sync_shm_ring *r, uint32_t head)
+{
+#ifdef __linux__
+	struct timespec to = { 0, 1000000 };
+	shm_store(&r->waiting, 1);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST); /* pairs with ring_wake() */
+	if (shm_load(&r->head) == head)
+		syscall(SYS_futex, &r->head, FUTEX_WAIT, head, &to, NULL, 0);
+	shm_store(&r->waiting, 0);
+#else
+	(void)r;
+	(void)head;
+	sched_yield();
+#endif
+}
+
+static int shm_alive(const struct sync_shm *s)
+{
+	return shm_load(&s->seg->state) == SYNC_SHM_CONNECTED &&
+	    shm_load(&s->seg->session) == s->session;
+}
+
+static long elapsed_ms(const struct timespec *start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000 +
+	    (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+struct sync_shm *sync_shm_attach(const char *name)
+{
+	struct sync_shm *s;
+	struct sync_shm_segment *seg;
+	uint32_t expected = SYNC_SHM_LISTENING;
+	int fd = shm_open(name, O_RDWR, 0);
+	if (fd < 0)
+		return NULL;
+
+	seg = mmap(NULL, sizeof(*seg), PROT_READ | PROT_WRITE, MAP_SHARED,
+	    fd, 0);
+	close(fd);
+	if (seg == MAP_FAILED)
+		return NULL;
+
+	if (seg->magic != SYNC_SHM_MAGIC || seg->version != SYNC_SHM_VERSION ||
+	    !__atomic_compare_exchange_n(&seg->state, &expected,
+	    SYNC_SHM_CONNECTED, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		munmap(seg, sizeof(*seg));
+		return NULL;
+	}
+
+	s = malloc(sizeof(*s));
+	if (!s) {
+		shm_store(&seg->state, SYNC_SHM_CLOSED);
+		munmap(seg, sizeof(*seg));
+		return NULL;
+	}
+
+	s->seg = seg;
+	s->in = &seg->to_demo;
+	s->out = &seg->to_editor;
+	s->session = shm_load(&seg->session);
+	shm_store(&seg->client_pid, (uint32_t)getpid());
+	return s;
+}
+
+void sync_shm_detach(struct sync_shm *s)
+{
+	if (shm_load(&s->seg->session) == s->session)
+		shm_store(&s->seg->state, SYNC_SHM_CLOSED);
+	ring_wake(s->out);
+	munmap(s->seg, sizeof(*s->seg));
+	free(s);
+}
+
+int sync_shm_send(struct sync_shm *s, const void *buf, size_t len)
+{
+	struct sync_shm_ring *r = s->out;
+	const unsigned char *src = buf;
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while (len) {
+		uint32_t head = r->head, tail = shm_load(&r->tail);
+		uint32_t pos = head & (SYNC_SHM_RING_SIZE - 1);
+		size_t n = SYNC_SHM_RING_SIZE - (head - tail);
+
+		if (!shm_alive(s))
+			return -1;
+
+		if (!n) {
+			/* ring full, wait for the editor to drain it */
+			if (elapsed_ms(&start) > SHM_STALL_TIMEOUT_MS)
+				return -1;
+			sched_yield();
+			continue;
+		}
+
+		if (n > len)
+			n = len;
+		if (n > SYNC_SHM_RING_SIZE - pos)
+			n = SYNC_SHM_RING_SIZE - pos;
+
+		memcpy(r->data + pos, src, n);
+		shm_store(&r->head, head + (uint32_t)n);
+		ring_wake(r);
+
+		src += n;
+		len -= n;
+	}
+	return 0;
+}
+
+int sync_shm_recv(struct sync_shm *s, void *buf, size_t len)
+{
+	struct sync_shm_ring *r = s->in;
+	unsigned char *dst = buf;
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while (len) {
+		uint32_t tail = r->tail, head = shm_load(&r->head);
+		uint32_t pos = tail & (SYNC_SHM_RING_SIZE - 1);
+		size_t n = head - tail;
+
+		if (!n) {
+			/* partial command, the rest is on its way */
+			if (!shm_alive(s) ||
+			    elapsed_ms(&start) > SHM_STALL_TIMEOUT_MS)
+				return -1;
+			ring_wait(r, head);
+			continue;
+		}
+
+		if (n > len)
+			n = len;
+		if (n > SYNC_SHM_RING_SIZE - pos)
+			n = SYNC_SHM_RING_SIZE - pos;
+
+		memcpy(dst, r->data + pos, n);
+		shm_store(&r->tail, tail + (uint32_t)n);
+
+		dst += n;
+		len -= n;
+	}
+	return 0;
+}
+
+int sync_shm_poll(struct sync_shm *s)
+{
+	/* report a dead peer as readable, so the following recv fails */
+	return !shm_alive(s) || shm_load(&s->in->head) != s->in->tail;
+}
+
+#endif /* defined(USE_SHM) */
@@ -0,0 +1,59 @@
+#ifndef SYNC_SHM_H
+#define SYNC_SHM_H
+
+#include "base.h"
+
+/*
+ * Shared-memory transport for editor and demo running on the same host.
+ *
+ * The editor creates a named segment holding two single-producer,
+ * single-consumer byte rings, one per direction, and carries the exact same
+ * byte-stream as the TCP transport. Sending is a memcpy plus a release-store;
+ * the only syscall is a wake-up when the reader is sleeping on the ring.
+ *
+ * The editor includes this header too, for the layout of the segment.
+ */
+
+#define SYNC_SHM_MAGIC 0x6b636f52 /* "Rock" */
+#define SYNC_SHM_VERSION 1
+#define SYNC_SHM_RING_SIZE (1 << 20) /* must be a power of two */
+
+enum {
+	SYNC_SHM_LISTENING = 1, /* editor waits for a demo */
+	SYNC_SHM_CONNECTED = 2, /* a demo has claimed the segment */
+	SYNC_SHM_CLOSED = 3     /* either side hung up */
+};
+
+struct sync_shm_ring {
+	uint32_t head;    /* bytes written, owned by the producer */
+	uint32_t waiting; /* non-zero while the consumer sleeps on head */
+	char pad0[56];
+	uint32_t tail;    /* bytes read, owned by the consumer */
+	char pad1[60];
+	unsigned char data[SYNC_SHM_RING_SIZE];
+};
+
+struct sync_shm_segment {
+	uint32_t magic, version;
+	uint32_t state;
+	uint32_t session; /* bumped by the editor every time it re-listens */
+	uint32_t client_pid;
+	char pad[44];
+	struct sync_shm_ring to_demo, to_editor;
+};
+
+#ifdef USE_SHM
+
+struct sync_shm;
+
+struct sync_shm *sync_shm_attach(const char *name);
+void sync_shm_detach(struct sync_shm *);
+
+/* same conventions as xsend/xrecv: non-zero on failure */
+int sync_shm_send(struct sync_shm *, const void *buf, size_t len);
+int sync_shm_recv(struct sync_shm *, void *buf, size_t len);
+int sync_shm_poll(struct sync_shm *);
+
+#endif /* defined(USE_SHM) */
+
+#endif /* SYNC_SHM_H */
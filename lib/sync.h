@@ -34,8 +34,37 @@ struct sync_cb {
 #define SYNC_DEFAULT_PORT 1338
 int sync_tcp_connect(struct sync_device *, const char *, unsigned short);
 int SYNC_DEPRECATED("use sync_tcp_connect instead") sync_connect(struct sync_device *, const char *, unsigned short);
+#define SYNC_DEFAULT_SHM_NAME "/rocket-1338"
+int sync_shm_connect(struct sync_device *, const char *);
 int sync_update(struct sync_device *, int, struct sync_cb *, void *);
 int sync_save_tracks(const struct sync_device *);
+
+#define SYNC_STATS_MAX_CMDS 8
+struct sync_stats {
+	unsigned long bytes_in, bytes_out;
+	unsigned long cmds_in[SYNC_STATS_MAX_CMDS];  /* indexed by command id */
+	unsigned long cmds_out[SYNC_STATS_MAX_CMDS];
+	size_t num_tracks;
+	double update_time;   /* seconds spent inside sync_update */
+	double worst_stall;   /* longest gap between two sync_update calls */
+	double evals_per_sec; /* sync_get_val calls, over the last second;
+	                         only counted after sync_count_evals() */
+	double rtt;           /* last PING round-trip in seconds, or -1 */
+};
+int sync_get_stats(const struct sync_device *, struct sync_stats *);
+void sync_reset_stats(struct sync_device *);
+
+/*
+ * Counting makes every sync_get_val() call write to the track, which
+ * costs demos that evaluate from several threads; off until enabled.
+ * Not to be called while tracks are being evaluated.
+ */
+void sync_count_evals(struct sync_device *, int enable);
+
+/* called with the name, start-time and duration in seconds of each event */
+typedef void (*sync_trace_fn)(void *, const char *, double, double);
+void sync_set_trace_cb(struct sync_device *, sync_trace_fn, void *);
+int sync_trace_to_file(struct sync_device *, const char *);
 #endif /* defined(SYNC_PLAYER) */
 
 struct sync_io_cb {
@@ -46,6 +75,11 @@ struct sync_io_cb {
 void sync_set_io_cb(struct sync_device *d, struct sync_io_cb *cb);
 
 const struct sync_track *sync_get_track(struct sync_device *, const char *);
+
+/*
+ * Safe to call from several threads at once, as long as none of them is
+ * inside sync_update() meanwhile; that is what changes the keys.
+ */
 double sync_get_val(const struct sync_track *, double);
 
 #ifdef __cplusplus
@@ -30,6 +30,10 @@ double sync_get_val(const struct sync_track *t, double row)
 {
 	int idx, irow;
 
+#ifndef SYNC_PLAYER
+	count_eval(t);
+#endif
+
 	/* If we have no keys at all, return a constant 0 */
 	if (!t->num_keys)
 		return 0.0f;
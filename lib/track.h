@@ -23,6 +23,10 @@ struct sync_track {
 	char *name;
 	struct track_key *keys;
 	int num_keys;
+#ifndef SYNC_PLAYER
+	int count_evals; /* only read by sync_get_val(), see sync_count_evals() */
+	unsigned long num_evals;
+#endif
 };
 
 int sync_find_key(const struct sync_track *, int);
@@ -35,6 +39,45 @@ static inline int key_idx_floor(const struct sync_track *t, int row)
 }
 
 #ifndef SYNC_PLAYER
+/*
+ * Demos may evaluate tracks from several threads at once. Unless asked
+ * for, sync_get_val() writes nothing; when counting, the count is the
+ * one thing it writes, and it does so atomically. Compilers without
+ * atomics below get a plain counter, and demos built with them must
+ * evaluate from one thread at a time while counting.
+ */
+#if defined(_MSC_VER)
+ #include <intrin.h>
+ #pragma intrinsic(_InterlockedIncrement)
+#endif
+
+static inline void count_eval(const struct sync_track *t)
+{
+	/* statistics only, the track itself is owned by the device */
+	unsigned long *n = &((struct sync_track *)t)->num_evals;
+	if (!t->count_evals)
+		return;
+#if defined(_MSC_VER)
+	/* long is 32-bit there, as is unsigned long */
+	_InterlockedIncrement((volatile long *)n);
+#elif defined(__ATOMIC_RELAXED)
+	__atomic_fetch_add(n, 1, __ATOMIC_RELAXED);
+#elif defined(__GNUC__)
+	__sync_fetch_and_add(n, 1);
+#else
+	++*n;
+#endif
+}
+
+static inline unsigned long get_num_evals(const struct sync_track *t)
+{
+#if defined(__ATOMIC_RELAXED)
+	return __atomic_load_n(&t->num_evals, __ATOMIC_RELAXED);
+#else
+	return *(const volatile unsigned long *)&t->num_evals;
+#endif
+}
+
 int sync_set_key(struct sync_track *, const struct track_key *);
 int sync_del_key(struct sync_track *, int);
 static inline int is_key_frame(const struct sync_track *t, int row)